@@ -0,0 +1,100 @@
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** xoshiro256** generator, seeded through splitmix64.
+ *
+ * "Scrambled linear pseudorandom number generators", David Blackman and
+ * Sebastiano Vigna, ACM TOMS 47.4 (2021): 1-32
+ *
+ * Satisfies UniformRandomBitGenerator, so it also drives <random>
+ * distributions and zipf.hpp.
+ */
+class xoshiro256ss
+{
+public:
+    typedef uint64_t result_type;
+
+    explicit xoshiro256ss(uint64_t seed = 0) { this->seed(seed); }
+
+    void seed(uint64_t seed)
+    {
+        for (int i = 0; i < 4; i++) {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            s[i] = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    result_type operator()()
+    {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+private:
+    static uint64_t rotl(const uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t s[4];
+};
+
+/** Map a random byte to [A-Za-z0-9]: index (b * 62) >> 8, then shift by range. */
+static inline char random_alnum(uint8_t b)
+{
+    uint8_t idx = (uint8_t)((b * 62u) >> 8);
+    return (char)('A' + idx + (idx >= 26) * ('a' - 'A' - 26) + (idx >= 52) * ('0' - 'a' - 26));
+}
+
+/** Fill out[0, len) with random alphanumerics, 16 bytes per SSE2 step.
+ * The scalar path maps the same bytes the same way, so the output for a
+ * given seed does not depend on the instruction set.
+ */
+static inline void fill_random_alnum(xoshiro256ss& rng, char* out, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i n62 = _mm_set1_epi16(62);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lt26 = _mm_set1_epi8(25), lt52 = _mm_set1_epi8(51);
+    const __m128i base = _mm_set1_epi8('A');
+    const __m128i to_lower = _mm_set1_epi8('a' - 'A' - 26), to_digit = _mm_set1_epi8('0' - 'a' - 26);
+    for (; i + 16 <= len; i += 16) {
+        uint64_t r[2] = {rng(), rng()};
+        __m128i b = _mm_loadu_si128((const __m128i*)r);
+        // (b * 62) >> 8 in 16-bit lanes, packed back to bytes
+        __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), n62), 8);
+        __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), n62), 8);
+        __m128i idx = _mm_packus_epi16(lo, hi);
+        __m128i c = _mm_add_epi8(idx, base);
+        c = _mm_add_epi8(c, _mm_and_si128(_mm_cmpgt_epi8(idx, lt26), to_lower));
+        c = _mm_add_epi8(c, _mm_and_si128(_mm_cmpgt_epi8(idx, lt52), to_digit));
+        _mm_storeu_si128((__m128i*)(out + i), c);
+    }
+#endif
+    for (; i < len; i += 8) {
+        uint64_t r = rng();
+        uint8_t b[8];
+        memcpy(b, &r, sizeof(r));
+        for (size_t j = 0; j < 8 && i + j < len; j++) {
+            out[i + j] = random_alnum(b[j]);
+        }
+    }
+}
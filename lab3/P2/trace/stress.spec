@@ -0,0 +1,11 @@
+# Scale-out run: 100M small strings (about 3GB of payload plus allocator overhead)
+items 100000000
+loops 1
+threads 1
+seed 10000
+sizes 12 16 24 32 48 64
+phase insert
+phase read 0.01 zipf 0.99
+phase delete 0.8
+phase insert
+phase delete 1.0
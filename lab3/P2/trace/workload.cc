@@ -12,9 +12,13 @@
 //#include "memlib.h"
 // #include "hamlet.h"
 //#include "config.h"
+#include "fast_random.hpp"
+#include "workload_spec.hpp"
 #include "zipf.hpp"
 
-#define MAX_ITEMS 1000000
+#ifndef MAX_ITEMS
+#define MAX_ITEMS 1000000L // Scale out with -DMAX_ITEMS=100000000L, or run stress.spec
+#endif
 #define LOOP_NUM 5
 #define SEED 10000
 #define WORKLOAD_TYPE 16
@@ -33,36 +37,18 @@ struct workload_base
     void **addr;
 };
 
+static xoshiro256ss string_rng(SEED); // Reseeded with srand(SEED), so every run is reproducible
+
 /*Generation of string with length*/
 char *gen_random_string(int length)
 {
-    int flag, i;
     char *string;
     if ((string = (char *)malloc(length)) == NULL)
     {
         std::cerr << "Malloc failed at genRandomString!" << std::endl;
         return NULL;
     }
-
-    for (i = 0; i < length - 1; i++)
-    {
-        flag = rand() % 3;
-        switch (flag)
-        {
-        case 0:
-            string[i] = 'A' + rand() % 26;
-            break;
-        case 1:
-            string[i] = 'a' + rand() % 26;
-            break;
-        case 2:
-            string[i] = '0' + rand() % 10;
-            break;
-        default:
-            string[i] = 'x';
-            break;
-        }
-    }
+    fill_random_alnum(string_rng, string, length - 1);
     string[length - 1] = '\0';
     return string;
 }
@@ -71,6 +57,7 @@ char *gen_random_string(int length)
 int workload_create(struct workload_base *workload)
 {
     srand(SEED);
+    string_rng.seed(SEED);
     // mem_init();
     /*if (mm_init() < 0)
     {
@@ -85,12 +72,13 @@ int workload_create(struct workload_base *workload)
 /* Insert strings up to 100% of MAX_ITEMS */
 int workload_insert(struct workload_base *workload)
 {
-    unsigned int size, total = 0;
-    for (int i = 0; i < MAX_ITEMS; i++)
+    unsigned int size;
+    size_t total = 0;
+    for (long i = 0; i < MAX_ITEMS; i++)
     {
         if (workload->addr[i] == 0)
         {
-            size = workload_size[rand() % WORKLOAD_TYPE];
+            size = workload_size[string_rng() % WORKLOAD_TYPE];
             workload->addr[i] = gen_random_string(size);
             total += size;
         }
@@ -101,7 +89,7 @@ int workload_insert(struct workload_base *workload)
 /* Sort strings */
 int workload_swap(struct workload_base *workload)
 {
-    for (int i = 1; i < MAX_ITEMS; i++)
+    for (long i = 1; i < MAX_ITEMS; i++)
     {
         void *temp;
         temp = workload->addr[i];
@@ -115,13 +103,15 @@ int workload_swap(struct workload_base *workload)
 int workload_read(struct workload_base *workload)
 {
     char reader[1025];
-    zipf_distribution<int, double> zipf(MAX_ITEMS - 1, 0.99);
+    long index[100];
+    zipf_alias_distribution<long, double> zipf(MAX_ITEMS - 1, 0.99);
     std::mt19937 generator2(SEED);
     for (int j = 0; j < 10; j++)
     {
+        zipf.generate(generator2, index, 100);
         for (int i = 0; i < 100; i++)
         {
-            strcpy(reader, (char *)workload->addr[zipf(generator2)]);
+            strcpy(reader, (char *)workload->addr[index[i]]);
         }
         sleep(1);
     }
@@ -130,7 +120,7 @@ int workload_read(struct workload_base *workload)
 /* Randomly delete 80% of strings */
 int workload_delete(struct workload_base *workload)
 {
-    for (int i = 0; i < MAX_ITEMS; i++)
+    for (long i = 0; i < MAX_ITEMS; i++)
     {
         if (rand() % 5 != 0)
         {
@@ -177,10 +167,27 @@ void *workload_run(void *workload)
     fout.close();
 }*/
 
-int main()
+/* Run a workload description file instead of the built-in phases */
+int spec_run(const char *path)
+{
+    workload_spec spec;
+    if (!spec.load(path))
+    {
+        return 1;
+    }
+    workload_ops ops = {malloc, free, realloc, NULL, true};
+    spec.run(ops);
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
     int error;
     struct workload_base workload;
+    if (argc > 1)
+    {
+        return spec_run(argv[1]);
+    }
     if (error = workload_create(&workload))
     {
         std::cerr << "workload creat error:" << error << std::endl;
@@ -0,0 +1,29 @@
+# Default page-scanner traffic: see workload_spec.hpp for the format
+items 1000000
+loops 5
+threads 1
+seed 10000
+sizes 12 16 24 32 48 64 96 100 128 192 256 384 500 512 768 1024
+phase insert
+phase swap
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase read 0.0001 zipf 0.99
+phase sleep 1000
+phase delete 0.8
@@ -0,0 +1,390 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+
+/** Compile-time configured version of the mm.c allocator.
+ *
+ * Same block layout as mm.c (header with size | prev_alloc | alloc, footer
+ * only on free blocks, explicit doubly linked free lists), but the header
+ * width, the fit policy and the size classes are template parameters, so
+ * every combination is compiled into its own fast path instead of being
+ * chosen at runtime. Each instance owns a private heap, several instances
+ * can be compared side by side.
+ *
+ *   Allocator<first_fit, single_list, 8>           mm.c mm_malloc
+ *   Allocator<best_fit, single_list, 8>            mm.c mm_malloc_best
+ *   Allocator<first_fit, geometric_classes<>, 4>   segregated, 4-byte headers
+ */
+
+namespace mm_template {
+
+constexpr size_t log2_floor(size_t x) { return x <= 1 ? 0 : 1 + log2_floor(x >> 1); }
+constexpr size_t pow2_floor(size_t x) { return (size_t)1 << log2_floor(x); }
+
+/** index_list<0, 1, ..., N - 1>, to expand a table element by element (C++11 has no index_sequence) */
+template <size_t... I> struct index_list {};
+template <size_t N, size_t... I> struct make_index_list : make_index_list<N - 1, N - 1, I...> {};
+template <size_t... I> struct make_index_list<0, I...> { typedef index_list<I...> type; };
+
+/* ---------------------------- Fit policies ---------------------------- */
+
+/** Return the first block of the list that is large enough */
+struct first_fit {
+    static constexpr const char* name = "first-fit";
+
+    template <class Heap>
+    static char* find(const Heap& heap, char* bp, size_t asize)
+    {
+        for (; bp != nullptr; bp = heap.next_free(bp)) {
+            if (heap.block_size(bp) >= asize) {
+                return bp;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/** Return the smallest block of the list that is large enough */
+struct best_fit {
+    static constexpr const char* name = "best-fit";
+
+    template <class Heap>
+    static char* find(const Heap& heap, char* bp, size_t asize)
+    {
+        char* res = nullptr;
+        size_t min = SIZE_MAX;
+        for (; bp != nullptr; bp = heap.next_free(bp)) {
+            size_t size = heap.block_size(bp);
+            if (size >= asize && size < min) {
+                min = size;
+                res = bp;
+                if (size == asize) {
+                    break;
+                }
+            }
+        }
+        return res;
+    }
+};
+
+/* ---------------------------- Size classes ---------------------------- */
+
+/** One free list for every size, as in mm.c */
+struct single_list {
+    static constexpr const char* name = "single-list";
+    static constexpr size_t count = 1;
+
+    static constexpr size_t of(size_t) { return 0; }
+};
+
+/** Segregated free lists.
+ *
+ * Sizes up to SmallMax use PerDoubling classes per power of two (8 bytes
+ * apart at least), looked up in a table that is generated at compile time.
+ * Larger sizes get one class per power of two. Class c holds blocks in
+ * [lower(c), lower(c + 1)), so any block in a higher class always fits.
+ */
+template <size_t SmallMax = 1024, size_t PerDoubling = 4>
+struct geometric_classes {
+    static_assert((SmallMax & (SmallMax - 1)) == 0 && SmallMax >= 64, "SmallMax must be a power of two >= 64");
+    static_assert(PerDoubling >= 1, "");
+
+    static constexpr const char* name = "geometric";
+    static constexpr size_t GRAIN = 8;  // Table granularity: smallest alignment of any header width
+    static constexpr size_t TABLE_LEN = SmallMax / GRAIN + 1;
+    static constexpr size_t count = 64;  // Fits a 64-bit non-empty mask
+
+    struct table_t {
+        uint8_t cls[TABLE_LEN];
+        size_t small_count;
+    };
+
+    /** Upper bound of the class whose lower bound is lower */
+    static constexpr size_t next_upper(size_t lower)
+    {
+        return lower + (pow2_floor(lower) / PerDoubling > GRAIN ? pow2_floor(lower) / PerDoubling : GRAIN);
+    }
+
+    /** Small class of size s, counting from class c, which covers [.., upper) */
+    static constexpr size_t small_class(size_t s, size_t c = 0, size_t upper = 2 * GRAIN)
+    {
+        return s < upper ? c : small_class(s, c + 1, next_upper(upper));
+    }
+
+    template <size_t... I>
+    static constexpr table_t build(index_list<I...>)
+    {
+        return table_t{{(uint8_t)small_class(I * GRAIN)...}, small_class(SmallMax) + 1};
+    }
+
+    static constexpr table_t table = build(typename make_index_list<TABLE_LEN>::type());
+    static_assert(table.small_count < count, "Too many small classes");
+
+    static size_t of(size_t asize)
+    {
+        size_t small = table.cls[std::min(asize, SmallMax) / GRAIN];
+        size_t large = std::min(count - 1, table.small_count + msb(asize) - msb(SmallMax));
+        return asize <= SmallMax ? small : large;  // Both computed: compiles to a cmov
+    }
+
+private:
+    static size_t msb(size_t x) { return 63 - __builtin_clzll(x | 1); }
+};
+
+// of() odr-uses table, which needs a definition before C++17
+template <size_t SmallMax, size_t PerDoubling>
+constexpr typename geometric_classes<SmallMax, PerDoubling>::table_t geometric_classes<SmallMax, PerDoubling>::table;
+
+/* ----------------------------- Allocator ------------------------------ */
+
+template <class FitPolicy, class SizeClasses, size_t HeaderWidth = 8>
+class Allocator
+{
+    static_assert(HeaderWidth == 4 || HeaderWidth == 8, "Header must be 4 or 8 bytes wide");
+    static_assert(SizeClasses::count <= 64, "Non-empty mask is 64 bits");
+
+    typedef typename std::conditional<HeaderWidth == 4, uint32_t, uint64_t>::type word;
+
+public:
+    static constexpr size_t WSIZE = HeaderWidth;               // Header/footer and free-list link size
+    static constexpr size_t ALIGNMENT = 2 * WSIZE;             // Payload alignment
+    static constexpr size_t MIN_BLK_SIZE = 2 * ALIGNMENT;      // Header + pred + succ + footer
+    static constexpr size_t CHUNKSIZE = 1 << 12;               // Extend heap by this amount (bytes)
+    static constexpr size_t MAX_CAPACITY = HeaderWidth == 4 ? ((size_t)1 << 32) - ALIGNMENT : (size_t)1 << 46;
+
+    explicit Allocator(size_t capacity = (size_t)1 << 30)
+    {
+        capacity = std::min(capacity, MAX_CAPACITY);
+        void* p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        base = (char*)p;
+        end = base + capacity;
+        // Offset 0 means NULL in free-list links, so the first payload starts after one alignment unit
+        brk = base + ALIGNMENT;
+        put(hdr(brk), PREV_ALLOC | ALLOC);  // Epilogue
+        memset(heads, 0, sizeof(heads));
+        nonempty = 0;
+        user_size = 0;
+    }
+
+    ~Allocator() { munmap(base, end - base); }
+
+    Allocator(const Allocator&) = delete;
+    Allocator& operator=(const Allocator&) = delete;
+
+    static const char* name() { return FitPolicy::name; }
+    static const char* classes_name() { return SizeClasses::name; }
+
+    void* allocate(size_t size)
+    {
+        if (size == 0) {
+            return nullptr;
+        }
+        size_t asize = std::max(MIN_BLK_SIZE, (size + WSIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+        char* bp = find_fit(asize);
+        if (bp == nullptr && (bp = extend_heap(std::max(asize, CHUNKSIZE))) == nullptr) {
+            return nullptr;
+        }
+        place(bp, asize);
+        user_size += block_size(bp) - WSIZE;
+        return bp;
+    }
+
+    void deallocate(void* ptr)
+    {
+        if (ptr == nullptr) {
+            return;
+        }
+        char* bp = (char*)ptr;
+        size_t size = block_size(bp);
+        user_size -= size - WSIZE;
+        put(hdr(bp), size | (get(hdr(bp)) & PREV_ALLOC));
+        put(ftr(bp), size);
+        char* next = bp + size;
+        put(hdr(next), get(hdr(next)) & ~PREV_ALLOC);
+        coalesce(bp);
+    }
+
+    void* reallocate(void* ptr, size_t size)
+    {
+        if (ptr == nullptr) {
+            return allocate(size);
+        }
+        if (size == 0) {
+            deallocate(ptr);
+            return nullptr;
+        }
+        char* bp = (char*)ptr;
+        size_t asize = std::max(MIN_BLK_SIZE, (size + WSIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+        size_t old = block_size(bp);
+        if (asize <= old) {
+            return bp;
+        }
+        // Grow in place if the next block is free and large enough
+        char* next = bp + old;
+        if (!(get(hdr(next)) & ALLOC) && old + block_size(next) >= asize) {
+            remove(next);
+            size_t total = old + block_size(next);
+            user_size += total - old;
+            put(hdr(bp), total | (get(hdr(bp)) & PREV_ALLOC) | ALLOC);
+            char* after = bp + total;
+            put(hdr(after), get(hdr(after)) | PREV_ALLOC);
+            return bp;
+        }
+        void* newptr = allocate(size);
+        if (newptr == nullptr) {
+            return nullptr;
+        }
+        memcpy(newptr, ptr, old - WSIZE);
+        deallocate(ptr);
+        return newptr;
+    }
+
+    size_t heap_size() const { return brk - base; }
+    size_t payload_size() const { return user_size; }
+    double utilization() const { return (double)user_size / heap_size(); }
+
+    /* Accessors used by the fit policies */
+    size_t block_size(const char* bp) const { return get(hdr(bp)) & ~FLAGS; }
+    char* next_free(const char* bp) const { return ptr(get(bp + WSIZE)); }
+
+private:
+    static constexpr word ALLOC = 1;
+    static constexpr word PREV_ALLOC = 2;
+    static constexpr word FLAGS = ALIGNMENT - 1;
+
+    static word get(const char* p) { return *(const word*)p; }
+    static void put(char* p, size_t val) { *(word*)p = (word)val; }
+    static char* hdr(const char* bp) { return (char*)bp - WSIZE; }
+    char* ftr(const char* bp) const { return (char*)bp + block_size(bp) - ALIGNMENT; }
+
+    /* Free-list links are offsets from base, so they fit in one header word */
+    char* ptr(word off) const { return off ? base + off : nullptr; }
+    word off(const char* p) const { return p ? (word)(p - base) : 0; }
+    char* prev_free(const char* bp) const { return ptr(get(bp)); }
+    void set_prev_free(char* bp, const char* p) { put(bp, off(p)); }
+    void set_next_free(char* bp, const char* p) { put(bp + WSIZE, off(p)); }
+
+    void insert(char* bp)
+    {
+        size_t c = SizeClasses::of(block_size(bp));
+        char* head = ptr(heads[c]);
+        set_prev_free(bp, nullptr);
+        set_next_free(bp, head);
+        if (head != nullptr) {
+            set_prev_free(head, bp);
+        }
+        heads[c] = off(bp);
+        nonempty |= (uint64_t)1 << c;
+    }
+
+    void remove(char* bp)
+    {
+        char* prev = prev_free(bp);
+        char* next = next_free(bp);
+        if (prev != nullptr) {
+            set_next_free(prev, next);
+        } else {
+            size_t c = SizeClasses::of(block_size(bp));
+            heads[c] = off(next);
+            if (next == nullptr) {
+                nonempty &= ~((uint64_t)1 << c);
+            }
+        }
+        if (next != nullptr) {
+            set_prev_free(next, prev);
+        }
+    }
+
+    char* find_fit(size_t asize)
+    {
+        size_t c = SizeClasses::of(asize);
+        char* bp = FitPolicy::find(*this, ptr(heads[c]), asize);
+        if (bp != nullptr) {
+            return bp;
+        }
+        // Every block of a higher class fits: take the first non-empty one
+        uint64_t higher = nonempty & ~(((uint64_t)2 << c) - 1);
+        if (higher == 0) {
+            return nullptr;
+        }
+        return FitPolicy::find(*this, ptr(heads[__builtin_ctzll(higher)]), asize);
+    }
+
+    char* extend_heap(size_t size)
+    {
+        if (size > (size_t)(end - brk)) {
+            return nullptr;
+        }
+        char* bp = brk;  // The old epilogue becomes the header of the new block
+        brk += size;
+        put(hdr(bp), size | (get(hdr(bp)) & PREV_ALLOC));
+        put(ftr(bp), size);
+        put(hdr(brk), ALLOC);  // New epilogue
+        return coalesce(bp);
+    }
+
+    char* coalesce(char* bp)
+    {
+        size_t size = block_size(bp);
+        char* next = bp + size;
+        bool prev_alloc = get(hdr(bp)) & PREV_ALLOC;
+        bool next_alloc = get(hdr(next)) & ALLOC;
+        if (!next_alloc) {
+            remove(next);
+            size += block_size(next);
+        }
+        if (!prev_alloc) {
+            char* prev = bp - (get(bp - ALIGNMENT) & ~FLAGS);
+            remove(prev);
+            size += block_size(prev);
+            bp = prev;
+        }
+        put(hdr(bp), size | PREV_ALLOC);  // Two free blocks are never adjacent
+        put(ftr(bp), size);
+        insert(bp);
+        return bp;
+    }
+
+    void place(char* bp, size_t asize)
+    {
+        size_t size = block_size(bp);
+        word prev_alloc = get(hdr(bp)) & PREV_ALLOC;
+        remove(bp);
+        if (size - asize >= MIN_BLK_SIZE) {
+            put(hdr(bp), asize | prev_alloc | ALLOC);
+            char* rest = bp + asize;
+            put(hdr(rest), (size - asize) | PREV_ALLOC);
+            put(ftr(rest), size - asize);
+            insert(rest);
+        } else {
+            put(hdr(bp), size | prev_alloc | ALLOC);
+            char* next = bp + size;
+            put(hdr(next), get(hdr(next)) | PREV_ALLOC);
+        }
+    }
+
+    char* base;  // Start of the private heap
+    char* brk;   // First byte after the epilogue header
+    char* end;   // End of the reserved region
+    word heads[SizeClasses::count];
+    uint64_t nonempty;  // Bit c set iff heads[c] != 0
+    size_t user_size;
+};
+
+// std::min and std::max take these by reference, which needs definitions before C++17
+template <class F, class S, size_t H> constexpr size_t Allocator<F, S, H>::WSIZE;
+template <class F, class S, size_t H> constexpr size_t Allocator<F, S, H>::ALIGNMENT;
+template <class F, class S, size_t H> constexpr size_t Allocator<F, S, H>::MIN_BLK_SIZE;
+template <class F, class S, size_t H> constexpr size_t Allocator<F, S, H>::CHUNKSIZE;
+template <class F, class S, size_t H> constexpr size_t Allocator<F, S, H>::MAX_CAPACITY;
+
+}  // namespace mm_template
@@ -60,6 +60,11 @@
  */
 #define MAX_HEAP (5* (1 << 20)) /* 5 MB */
 
+/*
+ * Address space memlib reserves for the heap (backed only when touched)
+ */
+#define MAX_RESERVE (64UL << 30) /* 64 GB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
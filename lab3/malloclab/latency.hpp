@@ -0,0 +1,255 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+#include "mm.h"
+
+/** Log-linear latency histogram (HdrHistogram style).
+ *
+ * Values below 2^SUB_BITS get one bucket each. Larger values are bucketed by
+ * the position of their highest set bit, then linearly by the SUB_BITS bits
+ * below it, so a bucket is never wider than 1/2^(SUB_BITS-1) of its value.
+ * Only the owning thread writes; readers may scan concurrently.
+ */
+class latency_histogram
+{
+public:
+    static constexpr int SUB_BITS = 5;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr int HALF_COUNT = SUB_COUNT / 2;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 2) * HALF_COUNT;
+
+    latency_histogram() { reset(); }
+
+    void record(uint64_t v)
+    {
+        bump(counts[index(v)]);
+        bump(total);
+        if (v > max.load(std::memory_order_relaxed)) {
+            max.store(v, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t maximum() const { return max.load(std::memory_order_relaxed); }
+
+    /** Upper bound of the bucket holding the p-th percentile sample. */
+    uint64_t percentile(double p) const
+    {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p / 100.0 * n + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(upper(i), maximum());
+            }
+        }
+        return maximum();
+    }
+
+    void merge(const latency_histogram& other)
+    {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i].fetch_add(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        total.fetch_add(other.count(), std::memory_order_relaxed);
+        if (other.maximum() > maximum()) {
+            max.store(other.maximum(), std::memory_order_relaxed);
+        }
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    /** Single writer: a relaxed load + store is enough, no locked add needed. */
+    static void bump(std::atomic<uint64_t>& c)
+    {
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static int index(uint64_t v)
+    {
+        if (v < SUB_COUNT) {
+            return (int)v;
+        }
+        int mag = 64 - __builtin_clzll(v) - SUB_BITS;  // >= 1, so v >> mag is in [HALF_COUNT, SUB_COUNT)
+        return mag * HALF_COUNT + (int)(v >> mag);
+    }
+
+    /** Largest value that falls into bucket i */
+    static uint64_t upper(int i)
+    {
+        if (i < SUB_COUNT) {
+            return i;
+        }
+        int mag = (i - SUB_COUNT) / HALF_COUNT + 1;
+        uint64_t sub = i - mag * HALF_COUNT;
+        return ((sub + 1) << mag) - 1;
+    }
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+};
+
+/** Allocator calls that are timed */
+enum latency_op {
+    LAT_MALLOC = 0,
+    LAT_MALLOC_BEST,
+    LAT_FREE,
+    LAT_REALLOC,
+    LAT_OP_NUM
+};
+
+/** Size classes by request size: <=16, <=32, ..., <=1024, >1024 */
+#define LAT_CLASS_NUM 8
+
+static inline int latency_size_class(size_t size)
+{
+    if (size <= 16) {
+        return 0;
+    }
+    int c = 64 - __builtin_clzll(size - 1) - 4;  // ceil(log2(size)) - 4
+    return std::min(c, LAT_CLASS_NUM - 1);
+}
+
+static inline uint64_t latency_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+/** Histograms of one thread. Registered once, then written without locks. */
+struct latency_table {
+    latency_histogram hist[LAT_OP_NUM][LAT_CLASS_NUM];
+};
+
+class latency_registry
+{
+public:
+    static latency_registry& instance()
+    {
+        static latency_registry r;
+        return r;
+    }
+
+    latency_table& local()
+    {
+        thread_local latency_table* table = nullptr;
+        if (table == nullptr) {
+            table = new latency_table;  // never freed: a report may run after the thread exits
+            std::lock_guard<std::mutex> guard(lock);
+            tables.push_back(table);
+        }
+        return *table;
+    }
+
+    /** Print p50/p99/p99.9/max (cycles) of all threads, per op and size class */
+    void report(std::ostream& out)
+    {
+        static const char* op_names[LAT_OP_NUM] = {"mm_malloc", "mm_malloc_best", "mm_free", "mm_realloc"};
+        static const char* class_names[LAT_CLASS_NUM] = {"<=16", "<=32", "<=64", "<=128", "<=256", "<=512", "<=1024", ">1024"};
+        std::lock_guard<std::mutex> guard(lock);
+        char line[128];
+        snprintf(line, sizeof(line), "  %-15s%-8s%10s%10s%10s%10s%10s", "op", "class", "count", "p50", "p99", "p99.9", "max");
+        out << line << std::endl;
+        latency_histogram* merged = new latency_histogram;
+        for (int op = 0; op < LAT_OP_NUM; op++) {
+            for (int c = 0; c < LAT_CLASS_NUM; c++) {
+                merged->reset();
+                for (latency_table* t : tables) {
+                    merged->merge(t->hist[op][c]);
+                }
+                if (merged->count() == 0) {
+                    continue;
+                }
+                snprintf(line, sizeof(line), "  %-15s%-8s%10lu%10lu%10lu%10lu%10lu", op_names[op], class_names[c],
+                         merged->count(), merged->percentile(50), merged->percentile(99),
+                         merged->percentile(99.9), merged->maximum());
+                out << line << std::endl;
+            }
+        }
+        delete merged;
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (latency_table* t : tables) {
+            for (int op = 0; op < LAT_OP_NUM; op++) {
+                for (int c = 0; c < LAT_CLASS_NUM; c++) {
+                    t->hist[op][c].reset();
+                }
+            }
+        }
+    }
+
+private:
+    std::mutex lock;  // Only guards the table list, never taken on the record path
+    std::vector<latency_table*> tables;
+};
+
+static inline void latency_record(latency_op op, size_t size, uint64_t start)
+{
+    uint64_t cycles = latency_now() - start;
+    latency_registry::instance().local().hist[op][latency_size_class(size)].record(cycles);
+}
+
+/* Timed wrappers of the mm.h interface */
+
+static inline void* hist_malloc(size_t size)
+{
+    uint64_t start = latency_now();
+    void* bp = mm_malloc(size);
+    latency_record(LAT_MALLOC, size, start);
+    return bp;
+}
+
+static inline void* hist_malloc_best(size_t size)
+{
+    uint64_t start = latency_now();
+    void* bp = mm_malloc_best(size);
+    latency_record(LAT_MALLOC_BEST, size, start);
+    return bp;
+}
+
+static inline void hist_free(void* ptr)
+{
+    size_t size = mm_payload_size(ptr);
+    uint64_t start = latency_now();
+    mm_free(ptr);
+    latency_record(LAT_FREE, size, start);
+}
+
+static inline void* hist_realloc(void* ptr, size_t size)
+{
+    uint64_t start = latency_now();
+    void* bp = mm_realloc(ptr, size);
+    latency_record(LAT_REALLOC, size, start);
+    return bp;
+}
@@ -3,23 +3,126 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "memlib.h"
 
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
 /* Private variables */
 static char* mem_start_brk;  // Points to first byte of heap
 static char* mem_brk;        // Points to last byte of heap
 static char* mem_max_addr;   // Largest legal heap address
+static size_t mem_mapped;    // Size of the mmap'ed heap region, 0 while the heap comes from sbrk
+
+/* Background pre-faulting of the memory just above mem_brk */
+static pthread_t prefault_thread;
+static pthread_mutex_t prefault_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefault_cond = PTHREAD_COND_INITIALIZER;
+static char* prefault_start;  // Pending range [prefault_start, prefault_end), guarded by prefault_lock
+static char* prefault_end;
+static char* prefault_done;   // Highest address already handed to the thread
+static int prefault_running;
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/*
+    Fault in [start, end) without changing its contents, so the heap may already be
+    using part of the range. MADV_POPULATE_WRITE (Linux 5.14) does it in one call;
+    otherwise each page gets a locked add of 0, which cannot lose a concurrent store.
+*/
+static void prefault_range(char* start, char* end) {
+    size_t page = mem_pagesize();
+    start = (char*)((unsigned long)start & ~(page - 1));
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, end - start, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    for (char* p = start; p < end; p += page)
+        __atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
+}
+
+static void* prefault_worker(void* arg) {
+    pthread_mutex_lock(&prefault_lock);
+    while (prefault_running) {
+        if (prefault_start >= prefault_end) {
+            pthread_cond_wait(&prefault_cond, &prefault_lock);
+            continue;
+        }
+        char* start = prefault_start;
+        char* end = prefault_end;
+        prefault_start = prefault_end;
+        pthread_mutex_unlock(&prefault_lock);
+        prefault_range(start, end);
+        pthread_mutex_lock(&prefault_lock);
+    }
+    pthread_mutex_unlock(&prefault_lock);
+    return NULL;
+}
+
+// Start (on != 0) or stop the background pre-fault thread
+void mem_prefault_enable(int on) {
+    if (on && !prefault_running) {
+        prefault_running = 1;
+        prefault_start = prefault_end = prefault_done = mem_brk;
+        if (pthread_create(&prefault_thread, NULL, prefault_worker, NULL) != 0)
+            prefault_running = 0;
+    } else if (!on && prefault_running) {
+        pthread_mutex_lock(&prefault_lock);
+        prefault_running = 0;
+        pthread_cond_signal(&prefault_cond);
+        pthread_mutex_unlock(&prefault_lock);
+        pthread_join(prefault_thread, NULL);
+    }
+}
+
+// Ask the pre-fault thread to fault in the next `bytes` above mem_brk (within the reserved heap). No-op when disabled.
+void mem_prefault(size_t bytes) {
+    if (!prefault_running)
+        return;
+    char* start = MAX(mem_brk, prefault_done);
+    char* end = mem_brk + MIN(bytes, (size_t)(mem_max_addr - mem_brk));
+    if (start >= end)
+        return;
+    prefault_done = end;
+    pthread_mutex_lock(&prefault_lock);
+    if (prefault_start >= prefault_end) {  // Idle: start a new range
+        prefault_start = start;
+        prefault_end = end;
+    } else {  // Merge into the pending range
+        prefault_start = MIN(prefault_start, start);
+        prefault_end = MAX(prefault_end, end);
+    }
+    pthread_cond_signal(&prefault_cond);
+    pthread_mutex_unlock(&prefault_lock);
+}
 
 // Initialize the memory system model
 void mem_init(void) {
+    /*
+        Reserve MAX_RESERVE bytes of address space up front. Pages are only backed once touched,
+        and the heap stays contiguous no matter who else calls sbrk (libc malloc does).
+    */
+    char* region = mmap(NULL, MAX_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region != MAP_FAILED) {
+        mem_start_brk = region;
+        mem_brk = region;
+        mem_max_addr = region + MAX_RESERVE;
+        mem_mapped = MAX_RESERVE;
+        return;
+    }
     /*
         调用 sbrk, 初始化 mem_start_brk、mem_brk、以及 mem_max_addr
         此处增长堆空间大小为 MAX_HEAP
@@ -32,17 +135,61 @@ void mem_init(void) {
 
 // Free the storage used by the memory system model
 void mem_deinit(void) {
-    free(mem_start_brk);
+    mem_prefault_enable(0);
+    if (mem_mapped) {
+        munmap(mem_start_brk, mem_mapped);
+        mem_mapped = 0;
+        return;
+    }
+    sbrk(-(intptr_t)(mem_max_addr - mem_start_brk));  // Only right if nothing was sbrk'ed after the heap
+}
+
+/*
+    Replace the heap with `size` bytes of file `fd` at `offset` (page aligned), mapped copy-on-write,
+    with room to grow up to `capacity` bytes reserved behind it. The heap is placed exactly at `base`,
+    or anywhere if `base` is NULL. Returns the new heap start, or NULL (old heap kept) on failure.
+*/
+void* mem_map_file(int fd, off_t offset, size_t size, size_t capacity, void* base) {
+    size_t page = mem_pagesize();
+    capacity = (MAX(capacity, size) + page - 1) & ~(page - 1);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (base ? MAP_FIXED_NOREPLACE : 0);
+    char* region = mmap(base, capacity, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (region == MAP_FAILED)
+        return NULL;
+    if (base && region != base) {  // Kernel without MAP_FIXED_NOREPLACE treats base as a hint
+        munmap(region, capacity);
+        return NULL;
+    }
+    if (size && mmap(region, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        munmap(region, capacity);
+        return NULL;
+    }
+    int prefaulting = prefault_running;
+    mem_prefault_enable(0);  // The thread may be touching the old heap
+    if (mem_mapped)
+        munmap(mem_start_brk, mem_mapped);
+    mem_start_brk = region;
+    mem_brk = region + size;
+    mem_max_addr = region + capacity;
+    mem_mapped = capacity;
+    mem_prefault_enable(prefaulting);
+    return region;
 }
 
 // Reset the simulated brk pointer to make an empty heap
 void mem_reset_brk() {
     mem_brk = mem_start_brk;
+    prefault_done = mem_brk;
 }
 
-// Simple model of the sbrk function. Extends the heap by incr bytes and returns the start address of the new area. In this model, the heap cannot be shrunk.
-void* mem_sbrk(int incr) {
+// Simple model of the sbrk function. Extends the heap by incr bytes and returns the start address of the new area. A negative incr shrinks the heap.
+void* mem_sbrk(intptr_t incr) {
     char* old_brk = mem_brk;
+    if (incr < 0 && mem_brk + incr < mem_start_brk) {
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Attempt to shrink below the heap start\n");
+        return (void*)-1;
+    }
     /*
             模拟堆增长
             incr: 申请 mem_brk 的增长量
@@ -52,9 +199,19 @@ void* mem_sbrk(int incr) {
         2. 若 mem_brk + incr 超过实际的 mem_max_addr 值，需要调用 sbrk 为内存分配器掌管的内存扩容
         3. 每次调用 sbrk 时， mem_max_addr 增量以 MAXHEAP对齐
     */
+    if (mem_brk + incr > mem_max_addr && mem_mapped) {  // A mapped heap cannot move past its reservation
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of reserved memory\n");
+        return (void*)-1;
+    }
     if (mem_brk + incr > mem_max_addr) { // Overflow: get more memory
-        unsigned short cnt = (incr - (mem_max_addr - old_brk) - 1) / MAX_HEAP + 1; 
-        sbrk(cnt * MAX_HEAP);
+        size_t cnt = (incr - (mem_max_addr - old_brk) - 1) / MAX_HEAP + 1;
+        if (sbrk(cnt * MAX_HEAP) != mem_max_addr) {  // Someone else moved the brk: the heap would not be contiguous
+            errno = ENOMEM;
+            fprintf(stderr, "ERROR: mem_sbrk failed. sbrk did not extend the heap in place\n");
+            return (void*)-1;
+        }
+        mem_max_addr += cnt * MAX_HEAP;
     }
     mem_brk += incr;
     return (void*)old_brk;
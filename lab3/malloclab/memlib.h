@@ -1,3 +1,5 @@
+#include <stdint.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #ifdef __cplusplus
@@ -6,12 +8,15 @@ extern "C" {
 
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void *mem_map_file(int fd, off_t offset, size_t size, size_t capacity, void *base);
+void mem_prefault_enable(int on);
+void mem_prefault(size_t bytes);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,11 @@
+# Realloc-heavy, mixed-lifetime and producer/consumer traffic: see workload_spec.hpp for the format
+items 50000
+loops 5
+threads 2
+seed 10000
+sizes 12 16 24 32 48 64 96 100 128 192 256 384 500 512 768 1024
+phase churn 4
+phase grow 2000 16384
+phase read 2 zipf 0.99
+phase handoff 20000
+phase delete 0.8
@@ -9,44 +9,83 @@
  * NOTE TO STUDENTS: Replace this header comment with your own header
  * comment that gives a high level description of your solution.
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "mm_probe.h"
 
 /*explicit free list start*/
 #define WSIZE 8              // Word and header/footer size (bytes)
 #define DSIZE 16             // Double word size(bytes)
 #define CHUNKSIZE (1 << 12)  // Extend heap by this amount (bytes)
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
-#define PACK(size, prev_alloc, alloc) ((size) & ~(1 << 1) | ((prev_alloc) << 1) & ~(1) | (alloc))  // Pack size, prev allocated and allocated bit into a word (PACK(size, 0, 0))
+// Adaptive heap growth: the extension doubles while the heap runs out quickly and halves when it doesn't
+#define GROW_MAX (CHUNKSIZE << 8)   // Largest extension (1 MiB)
+#define GROW_FAST_MALLOCS 64        // Fewer mallocs than this between extensions: grow faster
+#define GROW_SLOW_MALLOCS 4096      // More mallocs than this between extensions: grow slower
+
+/*
+    Header bits above any heap size carry two hints, so the free path reads no other word:
+        bits 58-63: size class of the block, used to pick its free list (see size_class())
+        bits 48-57: prev-free hint, the size / WSIZE of the previous block while it is free, 0 if unknown or too big
+    The hint is only meaningful while prev_alloc is 0; every write that makes a free block's size change
+    rewrites the hint of the block after it (SET_PREV_FREE).
+*/
+#define CLASS_NUM 32
+#define CLASS_SHIFT 58
+#define HINT_SHIFT 48
+#define HINT_MASK (((1UL << (CLASS_SHIFT - HINT_SHIFT)) - 1) << HINT_SHIFT)
+#define HINT_MAX ((HINT_MASK >> HINT_SHIFT) * WSIZE)                                 // Largest size the hint can hold
+#define HINT_BITS(size) ((size) <= HINT_MAX ? (unsigned long)(size) / WSIZE << HINT_SHIFT : 0)
+#define CLASS_BITS(size) ((unsigned long)size_class(size) << CLASS_SHIFT)
+
+#define PACK(size, prev_alloc, alloc) ((size) | CLASS_BITS(size) | ((prev_alloc) << 1) | (alloc))  // Pack size (and its class), prev allocated and allocated bit into a word (PACK(size, 0, 0))
 #define PACK_PREV_ALLOC(val, prev_alloc) ((val) & ~(1 << 1) | ((prev_alloc) << 1))                 // Pack size and prev allocated bit into a word (PACK_PREV_ALLOC(GET(HDRP(bp)), 0))
 #define PACK_ALLOC(val, alloc) ((val) | (alloc))                                                   // Pack size and allocated bit into a word (PACK_ALLOC(GET(HDRP(bp)), 0))
 
 #define GET(p) (*(unsigned long*)(p))               // Read a word at address p
 #define PUT(p, val) (*(unsigned long*)(p) = (val))  // Write a word at address p
 
-#define GET_SIZE(p) (GET(p) & ~0x7)              // Size of the block at address p (header/footer).
+#define GET_SIZE(p) (GET(p) & ((1UL << HINT_SHIFT) - 1) & ~0x7UL)  // Size of the block at address p (header/footer).
+#define GET_CLASS(p) (GET(p) >> CLASS_SHIFT)                        // Size class of the block at address p (header/footer)
+#define GET_HINT(p) (((GET(p) & HINT_MASK) >> HINT_SHIFT) * WSIZE)  // Size of the free block before address p (header), 0 if unknown
+#define SET_PREV_FREE(p, prev_size) (PUT(p, (GET(p) & ~(HINT_MASK | 0x2)) | HINT_BITS(prev_size)))  // The block before address p (header) is free and prev_size bytes long
 #define GET_ALLOC(p) (GET(p) & 0x1)              // Is the block at address p (header/footer) allocated?
 #define GET_PREV_ALLOC(p) ((GET(p) & 0x2) >> 1)  // Is the block before address p (header/footer) allocated?
+#define GET_MOVABLE(p) (GET(p) & 0x4)            // Is the allocated block at address p (header) owned by a handle?
+#define SET_MOVABLE(p) (PUT(p, GET(p) | 0x4))    // Mark the allocated block at address p (header) as owned by a handle
 
 #define HDRP(bp) ((char*)(bp)-WSIZE)                                 // Address of the block's header
 #define FTRP(bp) ((char*)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)          // Address of the block's footer. Only for free blk
 #define NEXT_BLKP(bp) ((char*)(bp) + GET_SIZE(((char*)(bp)-WSIZE)))  // Next block
 #define PREV_BLKP(bp) ((char*)(bp)-GET_SIZE(((char*)(bp)-DSIZE)))    // Prev block. Can only be used when prev_block is free.
 
-#define GET_PRED(bp) (GET(bp))            // Free block's prev free block
-#define SET_PRED(bp, val) (PUT(bp, val))  // Set free block's prev free block
+// Free-list links are stored as offsets from heap_base (0 for NULL), so a heap snapshot can be mapped at any address
+#define LINK_PTR(off) ((off) ? heap_base + (off) : NULL)             // Stored link to pointer
+#define LINK_OFF(p) ((p) ? (size_t)((char*)(p) - heap_base) : 0)    // Pointer to stored link
+
+#define GET_PRED(bp) (LINK_PTR(GET(bp)))            // Free block's prev free block
+#define SET_PRED(bp, val) (PUT(bp, LINK_OFF(val)))  // Set free block's prev free block
 
-#define GET_SUCC(bp) (GET(bp + WSIZE))            // Free block's next free block
-#define SET_SUCC(bp, val) (PUT(bp + WSIZE, val))  // Set free block's next free block
+#define GET_SUCC(bp) (LINK_PTR(GET((char*)(bp) + WSIZE)))            // Free block's next free block
+#define SET_SUCC(bp, val) (PUT((char*)(bp) + WSIZE, LINK_OFF(val)))  // Set free block's next free block
 
 #define MIN_BLK_SIZE (2 * DSIZE)  // Used for the sp place() function
+
+// Segregated free lists: the head of class c is a link stored in word c at the bottom of the heap,
+// so the heads are part of a snapshot's heap image
+#define LIST_HEAD(c) (((unsigned long*)heap_base)[c])
 /*explicit free list end*/
 
 /* single word (4) or double word (8) alignment */
@@ -57,10 +96,59 @@
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
+static char* heap_base;   // Start of the memlib heap, origin of free-list links
 static char* heap_listp;  // First mem block
-static char* free_listp;  // First free mem block
+static void* root_ptr;    // Application root object, saved in snapshots
+
+/*
+    Handle table for relocatable blocks. A used entry holds the block pointer (bp), a
+    free entry holds (next free index << 1 | 1). Index 0 is never handed out.
+    The first payload word of a handle-owned block stores its own handle, so
+    mm_compact() can find the entry to update when it moves the block.
+    The table is mmap'ed: libc malloc would share the brk area with memlib.
+*/
+static void** handle_table;
+static size_t handle_cap;
+static size_t handle_free;  // First free index, 0 if none
+
+/*
+    Cross-thread free. The heap belongs to one owner thread, which does every malloc.
+    mm_free from any other thread pushes the block onto remote_head, a lock-free
+    stack linked through the first payload word, and the owner frees the whole
+    stack in one batch on its next malloc. A single consumer that always takes
+    the whole stack with an exchange cannot hit ABA.
+*/
+static pthread_t heap_owner;
+static void* remote_head;   // Blocks freed by other threads, not yet returned to the free list
+static int remote_free = 1;  // 0: mm_free always frees directly; callers serialize themselves
+
+/*
+    Incremental heap checker. Every check_rate-th malloc/free checks the next check_budget
+    blocks in address order, resuming at check_cursor, so a full pass is spread over many calls.
+    coalesce() moves the cursor when it merges the block the cursor points at.
+*/
+static unsigned check_rate;       // 0: sampling off
+static unsigned check_budget = 16;
+static unsigned check_countdown;
+static char* check_cursor;        // Next block to check, NULL: start from the first block
+
+static size_t grow_size;           // Current heap extension size (bytes)
+static size_t mallocs_since_grow;  // Allocation rate estimate: mallocs since the last extension
+
+/*
+    Size class of a block of `size` bytes: class c holds [32 << c, 64 << c), the last class everything bigger.
+    Computed only when a block's size changes; the result is kept in the header (CLASS_BITS).
+*/
+static inline unsigned long size_class(size_t size) {
+    if (size < 2 * MIN_BLK_SIZE)
+        return 0;
+    return MIN(63 - __builtin_clzl(size) - 5, CLASS_NUM - 1);
+}
 
 static void* extend_heap(size_t words);
+static void* grow_heap(size_t asize);
+static void free_block(void* bp);
+static void check_sample(void);
 static void* coalesce(void* bp);
 // static void *find_fit(size_t asize);
 static void* find_fit_best(size_t asize);
@@ -89,13 +177,30 @@ double get_utilization() {  // Memory use percent: user_malloc_size/heap_size
 
 // Initialize the malloc package.
 int mm_init(void) {
-    free_listp = NULL;
-
-    // 通过 mem_sbrk 请求 4 个字的内存(模拟 sbrk)
-    if ((heap_listp = mem_sbrk(4 * WSIZE)) == (void*)-1) {
-        heap_size += 4 * WSIZE;  // HACK: heap_size
+    user_malloc_size = 0;
+    heap_size = 0;
+    if (handle_table != NULL)
+        munmap(handle_table, handle_cap * sizeof(void*));
+    handle_table = NULL;
+    handle_cap = 0;
+    handle_free = 0;
+
+    // 通过 mem_sbrk 请求 CLASS_NUM 个链表头 + 4 个字的内存(模拟 sbrk)
+    if ((heap_listp = mem_sbrk((CLASS_NUM + 4) * WSIZE)) == (void*)-1) {
+        heap_size += (CLASS_NUM + 4) * WSIZE;  // HACK: heap_size
         return -1;
     }
+    heap_base = heap_listp;
+    memset(heap_base, 0, CLASS_NUM * WSIZE);  // All free lists empty
+    heap_listp += CLASS_NUM * WSIZE;
+    root_ptr = NULL;
+    heap_owner = pthread_self();
+    __atomic_store_n(&remote_head, NULL, __ATOMIC_RELAXED);
+    grow_size = CHUNKSIZE;
+    mallocs_since_grow = 0;
+    check_cursor = NULL;
+    if (getenv("MM_CHECK_RATE") != NULL)  // Sampled checking without recompiling, e.g. MM_CHECK_RATE=1000
+        mm_check_config(atoi(getenv("MM_CHECK_RATE")), check_budget);
     // 分别作为填充块（为了对齐），序言块头/脚部，尾块
     // 并将 heap_listp 指针指向序言块使其作为链表的第一个节点
     PUT(heap_listp, 0);
@@ -116,24 +221,29 @@ void* mm_malloc(size_t size) {
     /*printf("\n in malloc : size=%u", size);*/
     /*mm_check(__FUNCTION__);*/
     size_t newsize;
-    size_t extend_size;
     void* bp;
 
     if (size == 0)
         return NULL;
+    if (__atomic_load_n(&remote_head, __ATOMIC_RELAXED) != NULL)
+        mm_drain_remote();
+    mallocs_since_grow++;
+    if (check_rate)
+        check_sample();
     newsize = MAX(MIN_BLK_SIZE, ALIGN((size + WSIZE))); /*size+WSIZE(head_len)*/
     if ((bp = find_fit_first(newsize)) != NULL) {
         place(bp, newsize);
         user_malloc_size += GET_SIZE(HDRP(bp)) - WSIZE;
+        MM_PROBE2(malloc, size, bp);
         return bp;
     }
     /*no fit found.*/
-    extend_size = MAX(newsize, CHUNKSIZE);
-    if ((bp = extend_heap(extend_size / WSIZE)) == NULL) {
+    if ((bp = grow_heap(newsize)) == NULL) {
         return NULL;
     }
     place(bp, newsize);
     user_malloc_size += GET_SIZE(HDRP(bp)) - WSIZE;
+    MM_PROBE2(malloc, size, bp);
     return bp;
 }
 
@@ -142,49 +252,80 @@ void* mm_malloc_best(size_t size) {
     /*printf("\n in malloc : size=%u", size);*/
     /*mm_check(__FUNCTION__);*/
     size_t newsize;
-    size_t extend_size;
     void* bp;
 
     if (size == 0)
         return NULL;
+    if (__atomic_load_n(&remote_head, __ATOMIC_RELAXED) != NULL)
+        mm_drain_remote();
+    mallocs_since_grow++;
+    if (check_rate)
+        check_sample();
     newsize = MAX(MIN_BLK_SIZE, ALIGN((size + WSIZE))); /*size+WSIZE(head_len)*/
     if ((bp = find_fit_best(newsize)) != NULL) {
         place(bp, newsize);
         user_malloc_size += GET_SIZE(HDRP(bp)) - WSIZE;
+        MM_PROBE2(malloc_best, size, bp);
         return bp;
     }
     /*no fit found.*/
-    extend_size = MAX(newsize, CHUNKSIZE);
-    if ((bp = extend_heap(extend_size / WSIZE)) == NULL) {
+    if ((bp = grow_heap(newsize)) == NULL) {
         return NULL;
     }
     place(bp, newsize);
     user_malloc_size += GET_SIZE(HDRP(bp)) - WSIZE;
+    MM_PROBE2(malloc_best, size, bp);
     return bp;
 }
-// Freeing a block.
+// Freeing a block. From a thread other than the heap owner, the block is queued for the owner.
 void mm_free(void* bp) {
-    size_t size = GET_SIZE(HDRP(bp));
-    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
-    void* head_next_bp = NULL;
+    if (remote_free && !pthread_equal(pthread_self(), heap_owner)) {
+        void* head = __atomic_load_n(&remote_head, __ATOMIC_RELAXED);
+        do {
+            PUT(bp, (unsigned long)head);
+        } while (!__atomic_compare_exchange_n(&remote_head, &head, bp, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        MM_PROBE1(remote_free, bp);
+        return;
+    }
+    free_block(bp);
+}
 
-    user_malloc_size -= size - WSIZE;
-    // mm_inspect(bp); // DEBUG
-    PUT(HDRP(bp), PACK(size, prev_alloc, 0));
-    PUT(FTRP(bp), PACK(size, prev_alloc, 0));
-    /*printf("%s, addr_start=%u, size_head=%u, size_foot=%u\n",*/
-    /*    __FUNCTION__, HDRP(bp), (size_t)GET_SIZE(HDRP(bp)), (size_t)GET_SIZE(FTRP(bp)));*/
+// Free every block queued by other threads. Owner only. Returns the number of blocks freed.
+size_t mm_drain_remote(void) {
+    size_t n = 0;
+    char* bp = __atomic_exchange_n(&remote_head, NULL, __ATOMIC_ACQUIRE);
+    while (bp != NULL) {
+        char* next = (char*)GET(bp);
+        free_block(bp);
+        bp = next;
+        n++;
+    }
+    MM_PROBE1(remote_drain, n);
+    return n;
+}
 
-    /*notify next_block, i am free*/
-    // mm_inspect(NEXT_BLKP(bp)); // DEBUG
-    head_next_bp = HDRP(NEXT_BLKP(bp));
-    PUT(head_next_bp, PACK_PREV_ALLOC(GET(head_next_bp), 0));
-    // if (GET_ALLOC(head_next_bp) == 0) { // coalesce will modify the tail
-    //     PUT(FTRP(NEXT_BLKP(bp)), PACK_PREV_ALLOC(GET(head_next_bp), 0));
-    // }
+// Make the calling thread the heap owner. mm_init makes its caller the owner.
+void mm_set_owner(void) {
+    mm_drain_remote();
+    heap_owner = pthread_self();
+}
+
+// on = 0: mm_free never queues, every caller frees directly (the caller must serialize all mm calls)
+void mm_set_remote_free(int on) {
+    remote_free = on;
+}
 
-    // add_to_free_list(bp);
+static void free_block(void* bp) {
+    size_t size = GET_SIZE(HDRP(bp));
 
+    if (check_rate)
+        check_sample();
+    user_malloc_size -= size - WSIZE;
+    MM_PROBE2(free, bp, size);
+    // mm_inspect(bp); // DEBUG
+    // Clear the alloc and movable bits only: size, class and prev-free hint stay valid.
+    // coalesce() writes the footer and tells the next block (its prev_alloc bit and hint).
+    PUT(HDRP(bp), GET(HDRP(bp)) & ~0x5UL);
     coalesce(bp);
 }
 
@@ -194,10 +335,16 @@ void* mm_realloc(void* ptr, size_t size) {
     void* newptr;
     size_t copySize;
 
+    if (oldptr == NULL)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(oldptr);
+        return NULL;
+    }
     newptr = mm_malloc(size);
     if (newptr == NULL)
         return NULL;
-    copySize = *(size_t*)((char*)oldptr - SIZE_T_SIZE);
+    copySize = mm_payload_size(oldptr);  // The header word also holds the flag bits
     if (size < copySize)
         copySize = size;
     memcpy(newptr, oldptr, copySize);
@@ -205,6 +352,234 @@ void* mm_realloc(void* ptr, size_t size) {
     return newptr;
 }
 
+// Usable bytes of the allocated block at `ptr`
+size_t mm_payload_size(void* ptr) {
+    if (ptr == NULL)
+        return 0;
+    return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+// Allocate a relocatable block of `size` bytes. Returns 0 on failure.
+mm_handle_t mm_handle_alloc(size_t size) {
+    mm_handle_t h;
+    if (handle_free == 0) {  // Table full: double it and chain the new entries
+        size_t new_cap = handle_cap ? handle_cap * 2 : 1024;
+        void** new_table = handle_cap ? mremap(handle_table, handle_cap * sizeof(void*), new_cap * sizeof(void*), MREMAP_MAYMOVE)
+                                      : mmap(NULL, new_cap * sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (new_table == MAP_FAILED)
+            return 0;
+        for (size_t i = (handle_cap ? handle_cap : 1); i < new_cap; i++)
+            new_table[i] = (void*)(((i + 1 < new_cap ? i + 1 : 0) << 1) | 1);
+        handle_free = handle_cap ? handle_cap : 1;
+        handle_table = new_table;
+        handle_cap = new_cap;
+    }
+    char* bp = mm_malloc(size + WSIZE);
+    if (bp == NULL)
+        return 0;
+    h = handle_free;
+    handle_free = (size_t)handle_table[h] >> 1;
+    handle_table[h] = bp;
+    SET_MOVABLE(HDRP(bp));
+    PUT(bp, h);
+    return h;
+}
+
+// Current address of the payload of handle `h`. Only valid until the next mm_compact().
+void* mm_handle_deref(mm_handle_t h) {
+    return (char*)handle_table[h] + WSIZE;
+}
+
+void mm_handle_free(mm_handle_t h) {
+    if (h == 0)
+        return;
+    char* bp = handle_table[h];
+    handle_table[h] = (void*)((handle_free << 1) | 1);
+    handle_free = h;
+    mm_free(bp);
+}
+
+/*
+    Slide handle-owned blocks toward heap_listp, closing the free gaps between them.
+    Blocks from mm_malloc are pinned: the gap in front of one stays a free block.
+    The free space left at the top of the heap is given back to memlib.
+    Returns the number of bytes the heap shrank by.
+*/
+size_t mm_compact(void) {
+    mm_drain_remote();  // Queued blocks are still marked allocated and would be moved
+    check_cursor = NULL;
+    char* bp = NEXT_BLKP(heap_listp);
+    char* gap = NULL;  // Header address where the current free gap starts
+    memset(heap_base, 0, CLASS_NUM * WSIZE);  // Free lists are rebuilt from the gaps that remain
+    while (GET_SIZE(HDRP(bp)) != 0) {
+        size_t size = GET_SIZE(HDRP(bp));
+        char* next = NEXT_BLKP(bp);
+        if (!GET_ALLOC(HDRP(bp))) {
+            if (gap == NULL)
+                gap = HDRP(bp);
+        } else if (gap != NULL && GET_MOVABLE(HDRP(bp))) {
+            memmove(gap, HDRP(bp), size);
+            PUT(gap, PACK_PREV_ALLOC(GET(gap), 1));
+            handle_table[GET(gap + WSIZE)] = gap + WSIZE;
+            gap += size;
+        } else if (gap != NULL) {  // Pinned block: the gap in front of it becomes a free block
+            size_t gap_size = HDRP(bp) - gap;
+            PUT(gap, PACK(gap_size, 1, 0));
+            PUT(FTRP(gap + WSIZE), PACK(gap_size, 1, 0));
+            add_to_free_list(gap + WSIZE);
+            SET_PREV_FREE(HDRP(bp), gap_size);
+            gap = NULL;
+        }
+        bp = next;
+    }
+    if (gap == NULL)
+        return 0;
+    // bp is the epilogue: move it down to the gap and shrink the heap
+    size_t trimmed = HDRP(bp) - gap;
+    PUT(gap, PACK(0, 1, 1));
+    mem_sbrk(-(intptr_t)trimmed);
+    heap_size -= trimmed;
+    MM_PROBE1(compact, trimmed);
+    return trimmed;
+}
+
+/*
+    Snapshot file layout: a header page, the heap image from mem_heap_lo() on the next
+    page boundary (so it can be mmap'ed in place), then the handle table. Every pointer
+    is stored as an offset from heap_base, which makes the image relocatable.
+    The free-list heads live at the bottom of the heap image.
+*/
+#define SNAPSHOT_MAGIC "MMSNAP2"
+#define SNAPSHOT_PAGE 4096
+#define SNAPSHOT_GROWTH (1UL << 32)  // Address space reserved behind a restored heap
+
+typedef struct {
+    char magic[8];
+    size_t base;            // mem_heap_lo() when the snapshot was taken
+    size_t heap_bytes;      // mem_heapsize()
+    size_t heap_base_off;   // heap_base - mem_heap_lo()
+    size_t heap_listp_off;  // Offsets from heap_base, 0 for NULL
+    size_t root_off;
+    size_t user_malloc_size;
+    size_t heap_size;
+    size_t handle_cap;
+    size_t handle_free;
+} snapshot_header;
+
+// Mark `ptr` (a block of this heap) as the object to return from mm_get_root() after a restore
+void mm_set_root(void* ptr) {
+    root_ptr = ptr;
+}
+
+void* mm_get_root(void) {
+    return root_ptr;
+}
+
+static int write_all(int fd, const void* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n <= 0)
+            return -1;
+        buf = (const char*)buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// Write the heap, the free-list roots and the handle table to `path`. Returns 0 on success.
+int mm_snapshot(const char* path) {
+    snapshot_header h;
+    mm_drain_remote();
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.base = (size_t)mem_heap_lo();
+    h.heap_bytes = mem_heapsize();
+    h.heap_base_off = heap_base - (char*)mem_heap_lo();
+    h.heap_listp_off = LINK_OFF(heap_listp);
+    h.root_off = LINK_OFF(root_ptr);
+    h.user_malloc_size = user_malloc_size;
+    h.heap_size = heap_size;
+    h.handle_cap = handle_cap;
+    h.handle_free = handle_free;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    int ret = write_all(fd, &h, sizeof(h), 0);
+    if (ret == 0)
+        ret = write_all(fd, mem_heap_lo(), h.heap_bytes, SNAPSHOT_PAGE);
+    // Used handle entries become offsets, free ones (odd) are kept as they are
+    off_t off = SNAPSHOT_PAGE + ((h.heap_bytes + SNAPSHOT_PAGE - 1) & ~(size_t)(SNAPSHOT_PAGE - 1));
+    size_t buf[512];
+    for (size_t i = 0; ret == 0 && i < handle_cap; i += 512) {
+        size_t n = handle_cap - i < 512 ? handle_cap - i : 512;
+        for (size_t j = 0; j < n; j++) {
+            size_t e = (size_t)handle_table[i + j];
+            buf[j] = (e & 1) ? e : LINK_OFF(e);
+        }
+        ret = write_all(fd, buf, n * sizeof(size_t), off + i * sizeof(size_t));
+    }
+    if (close(fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+/*
+    Replace the current heap with the snapshot at `path`. The image is mmap'ed copy-on-write at its
+    original address, so absolute pointers stored in it stay valid. If that address is taken and
+    `relocatable` is set, it is mapped anywhere instead (only offsets and handles survive that).
+    Returns 0 on success, -1 if nothing was changed.
+*/
+int mm_restore(const char* path, int relocatable) {
+    snapshot_header h;
+    mm_drain_remote();  // Queued blocks belong to the heap that is about to be replaced
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) {
+        close(fd);
+        return -1;
+    }
+    void** table = NULL;
+    if (h.handle_cap) {
+        table = mmap(NULL, h.handle_cap * sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        off_t off = SNAPSHOT_PAGE + ((h.heap_bytes + SNAPSHOT_PAGE - 1) & ~(size_t)(SNAPSHOT_PAGE - 1));
+        if (table == MAP_FAILED || pread(fd, table, h.handle_cap * sizeof(void*), off) != (ssize_t)(h.handle_cap * sizeof(void*))) {
+            if (table != MAP_FAILED)
+                munmap(table, h.handle_cap * sizeof(void*));
+            close(fd);
+            return -1;
+        }
+    }
+    char* lo = mem_map_file(fd, SNAPSHOT_PAGE, h.heap_bytes, h.heap_bytes + SNAPSHOT_GROWTH, (void*)h.base);
+    if (lo == NULL && relocatable)
+        lo = mem_map_file(fd, SNAPSHOT_PAGE, h.heap_bytes, h.heap_bytes + SNAPSHOT_GROWTH, NULL);
+    close(fd);
+    if (lo == NULL) {
+        if (table != NULL)
+            munmap(table, h.handle_cap * sizeof(void*));
+        return -1;
+    }
+
+    heap_base = lo + h.heap_base_off;
+    heap_listp = LINK_PTR(h.heap_listp_off);
+    check_cursor = NULL;
+    root_ptr = LINK_PTR(h.root_off);
+    user_malloc_size = h.user_malloc_size;
+    heap_size = h.heap_size;
+    if (handle_table != NULL)
+        munmap(handle_table, handle_cap * sizeof(void*));
+    for (size_t i = 0; i < h.handle_cap; i++) {
+        size_t e = (size_t)table[i];
+        table[i] = (e & 1) ? (void*)e : LINK_PTR(e);
+    }
+    handle_table = table;
+    handle_cap = h.handle_cap;
+    handle_free = h.handle_free;
+    return 0;
+}
+
 static void* extend_heap(size_t words) {
     /*get heap_brk*/
     char* old_heap_brk = mem_sbrk(0);
@@ -220,101 +595,123 @@ static void* extend_heap(size_t words) {
     }
 
     heap_size += size;                        // HACK: heap_size
-    PUT(HDRP(bp), PACK(size, prev_alloc, 0)); /*last free block*/
+    MM_PROBE2(extend_heap, size, heap_size);
+    PUT(HDRP(bp), PACK(size, prev_alloc, 0) | (GET(HDRP(bp)) & HINT_MASK)); /*last free block, keeps the old epilogue's hint*/
     PUT(FTRP(bp), PACK(size, prev_alloc, 0));
 
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 0, 1)); /*break block*/
     return coalesce(bp);
 }
 
+// Extend the heap for a request of asize bytes, sizing the extension by how fast the last one was used up
+static void* grow_heap(size_t asize) {
+    if (mallocs_since_grow < GROW_FAST_MALLOCS)
+        grow_size = MIN(grow_size * 2, GROW_MAX);
+    else if (mallocs_since_grow > GROW_SLOW_MALLOCS)
+        grow_size = MAX(grow_size / 2, CHUNKSIZE);
+    mallocs_since_grow = 0;
+
+    void* bp = extend_heap(MAX(asize, grow_size) / WSIZE);
+    mem_prefault(grow_size);  // Fault in the next extension in the background, if enabled
+    return bp;
+}
+
 // 将 bp 指向的空闲块与相邻块合并
 static void* coalesce(void* bp) {
     // 首先从前一块的脚部和后一块的头部获取相应的分配状态。
     void* next_bp = NEXT_BLKP(bp);
-    void* prev_bp = PREV_BLKP(bp);
+    void* prev_bp = NULL;
     size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(next_bp));
     size_t size = GET_SIZE(HDRP(bp));
     size_t next_size = GET_SIZE(HDRP(next_bp));
+    size_t prev_size = 0;
+    if (!prev_alloc) {  // 前块大小优先取自身块头里的 prev-free 提示，只有提示为 0 时才读前块块尾
+        prev_size = GET_HINT(HDRP(bp));
+        if (prev_size == 0)
+            prev_size = GET_SIZE((char*)bp - DSIZE);
+        prev_bp = (char*)bp - prev_size;
+    }
     // 根据 4 种不同情况作相应处理
     // 合并的过程中，要从空闲链表中删除合并前的空闲块并且插入合并后的空闲块。(bp 一开始就不在空闲链表中，所以不需要删除它)
     // 由于序言块和尾块的存在，不需要考虑边界条件，进行合并操作的块一定不会触及堆底和堆顶，因此不需要检查合并块位置。
-    if (prev_alloc && next_alloc) {                 // * 前后都是已分配的块
-        PUT(HDRP(next_bp), PACK(next_size, 0, 1));  // 修改后块块头
-        PUT(HDRP(bp), PACK(size, 1, 0));            // 修改自身块头
-        PUT(FTRP(bp), PACK(size, 1, 0));            // 修改自身块尾
-    } else if (prev_alloc && !next_alloc) {         // * 前块已分，后块空闲
+    if (prev_alloc && next_alloc) {       // * 前后都是已分配的块
+        PUT(FTRP(bp), GET(HDRP(bp)));     // 块头（大小类）不变，块尾照抄
+    } else if (prev_alloc && !next_alloc) {  // * 前块已分，后块空闲
         size += next_size;
         delete_from_free_list(next_bp);
-        PUT(FTRP(next_bp), PACK(size, 1, 0));  // 修改后块块尾
-        PUT(HDRP(bp), PACK(size, 1, 0));       // 修改自身块头
-    } else if (!prev_alloc && next_alloc) {    // * 前块空闲，后块已分
-        size += GET_SIZE(HDRP(prev_bp));
+        PUT(HDRP(bp), PACK(size, 1, 0));  // 修改自身块头
+        PUT(FTRP(bp), PACK(size, 1, 0));  // 修改后块块尾
+    } else if (!prev_alloc && next_alloc) {  // * 前块空闲，后块已分
+        size += prev_size;
         delete_from_free_list(prev_bp);
-        PUT(FTRP(bp), PACK(size, 1, 0));            // 修改自身块尾
-        PUT(HDRP(prev_bp), PACK(size, 1, 0));       // 修改前块块头
-        PUT(HDRP(next_bp), PACK(next_size, 0, 1));  // 修改后块块头
+        PUT(HDRP(prev_bp), PACK(size, 1, 0));  // 修改前块块头
+        PUT(FTRP(prev_bp), PACK(size, 1, 0));  // 修改自身块尾
         bp = prev_bp;
     } else {  // * 前后都是空闲
-        size += GET_SIZE(HDRP(prev_bp)) + next_size;
+        size += prev_size + next_size;
         delete_from_free_list(prev_bp);
         delete_from_free_list(next_bp);
         PUT(HDRP(prev_bp), PACK(size, 1, 0));  // 修改前块块头
-        PUT(FTRP(next_bp), PACK(size, 1, 0));  // 修改后块块尾
+        PUT(FTRP(prev_bp), PACK(size, 1, 0));  // 修改后块块尾
         bp = prev_bp;
     }
+    SET_PREV_FREE(HDRP(NEXT_BLKP(bp)), size);  // 修改后块块头：prev_alloc 清零，记下合并后的大小
+    MM_PROBE3(coalesce, bp, size, (!prev_alloc << 1) | !next_alloc);  // Case: bit 1 merged prev, bit 0 merged next
+    if (check_cursor > (char*)bp && check_cursor < (char*)bp + size)  // The cursor's block was merged away
+        check_cursor = bp;
     add_to_free_list(bp);
     // 最后返回合并后的指针
     return bp;
 }
 
-// 首次匹配算法：遍历 freelist， 找到第一个合适的空闲块后返回
+// 首次匹配算法：从 asize 所在的大小类开始遍历各个 freelist，找到第一个合适的空闲块后返回
+// 更大的类中任何块都放得下，所以只有第一个非空类可能需要多看几块
 static void* find_fit_first(size_t asize) {
-    void* cur = free_listp;
-    while (cur != NULL) {
-        if (GET_SIZE(HDRP(cur)) >= asize) {
-            return cur;
+    size_t steps = 0;  // Free-list nodes visited, reported by the find_fit probe (counted only when probes are built in)
+    for (unsigned long c = size_class(asize); c < CLASS_NUM; c++) {
+        for (char* cur = LINK_PTR(LIST_HEAD(c)); cur != NULL; cur = GET_SUCC(cur)) {
+            if (GET_SIZE(HDRP(cur)) >= asize) {
+                MM_PROBE3(find_fit, asize, steps, 1);
+                return cur;
+            }
+            MM_PROBE_COUNT(steps);
         }
-        cur = GET_SUCC(cur);
     }
+    MM_PROBE3(find_fit, asize, steps, 0);
     return NULL;
 }
 
 static void* find_fit_best(size_t asize) {
     /*
         最佳配算法
-            遍历 freelist， 找到最合适的空闲块，返回
+            从 asize 所在的大小类开始，在第一个有合适块的类中找最合适的空闲块，返回
+            (更大的类中的块都比这个类中的大)
 
         HINT: asize 已经计算了块头部的大小
     */
     // mm_check(__FUNCTION__); // DEBUG
-    void* cur = free_listp;
-    void* res;
-    size_t size;
-    size_t min = 0;
-    while (cur != NULL) {
-        if ((size = GET_SIZE(HDRP(cur))) >= asize) {
-            min = size;
-            res = cur;
-            break;
+    size_t steps = 0;  // Free-list nodes visited, reported by the find_fit probe (counted only when probes are built in)
+    for (unsigned long c = size_class(asize); c < CLASS_NUM; c++) {
+        char* res = NULL;
+        size_t min = 0;
+        for (char* cur = LINK_PTR(LIST_HEAD(c)); cur != NULL; cur = GET_SUCC(cur)) {
+            size_t size = GET_SIZE(HDRP(cur));
+            MM_PROBE_COUNT(steps);
+            if (size >= asize && (res == NULL || size < min)) {
+                min = size;
+                res = cur;
+                if (size == asize)  // Exact fit, nothing better to find
+                    break;
+            }
         }
-        cur = GET_SUCC(cur);
-    }
-    if (min == 0)
-        return NULL;
-    while (cur != NULL) {
-        size = GET_SIZE(HDRP(cur));
-        if (size >= asize && size < min) {
-            min = size;
-            res = cur;
-            break;
+        if (res != NULL) {
+            MM_PROBE3(find_fit, asize, steps, 1);
+            return res;
         }
-        cur = GET_SUCC(cur);
     }
-    if (min == 0)
-        return NULL;
-    else
-        return res;
+    MM_PROBE3(find_fit, asize, steps, 0);
+    return NULL;
 }
 
 // 将一个空闲块转变为已分配的块
@@ -336,9 +733,9 @@ static void place(void* bp, size_t asize) {
         // mm_inspect(NEXT_BLKP(bp)); // DEBUG
         void* head_next_bp = HDRP(NEXT_BLKP(bp));
         delete_from_free_list(bp);
-        PUT(HDRP(bp), PACK(blk_size, GET_PREV_ALLOC(HDRP(bp)), 1));
+        PUT(HDRP(bp), PACK_ALLOC(GET(HDRP(bp)), 1));  // 大小和大小类不变
         assert(GET_ALLOC(head_next_bp));                        // 后块必已分配
-        PUT(head_next_bp, PACK(GET_SIZE(head_next_bp), 1, 1));  // 修改后一个块的块头
+        PUT(head_next_bp, PACK_PREV_ALLOC(GET(head_next_bp), 1));  // 修改后一个块的块头
         // mm_inspect(bp); // DEBUG
         // mm_inspect(NEXT_BLKP(bp)); // DEBUG
     } else {  // 原空闲块被分割为一个已分配块+一个新的空闲块
@@ -348,65 +745,135 @@ static void place(void* bp, size_t asize) {
         void* next = NEXT_BLKP(bp);
         PUT(HDRP(next), PACK(blk_size - asize, 1, 0));
         PUT(FTRP(next), PACK(blk_size - asize, 1, 0));
+        SET_PREV_FREE(HDRP(NEXT_BLKP(next)), blk_size - asize);  // 后块的前块变小了，更新提示
         add_to_free_list(next);
         // mm_inspect(bp); // DEBUG
         // mm_inspect(next); // DEBUG
     }
 }
 
+// 插入到块头中记录的大小类的链表头部
 static void add_to_free_list(void* bp) {
     /*set pred & succ*/
     // printf("+ Adding %zx to free list...\n", bp); // DEBUG
-    if (free_listp == NULL) {  // free_list empty
-        SET_PRED(bp, 0);
-        SET_SUCC(bp, 0);
-        free_listp = bp;
-    } else {
-        SET_PRED(bp, 0);
-        SET_SUCC(bp, (size_t)free_listp); /*size_t ???*/
-        SET_PRED(free_listp, (size_t)bp);
-        free_listp = bp;
-    }
+    unsigned long c = GET_CLASS(HDRP(bp));
+    char* head = LINK_PTR(LIST_HEAD(c));
+    SET_PRED(bp, 0);
+    SET_SUCC(bp, head);
+    if (head != NULL)
+        SET_PRED(head, bp);
+    LIST_HEAD(c) = LINK_OFF(bp);
     // mm_check(__FUNCTION__); // DEBUG
 }
 
+// 块头必须还是插入时的大小类
 static void delete_from_free_list(void* bp) {
     // printf("- Deleting %zx from free list...\n", bp); // DEBUG
-    void* prev_free_bp = 0;
-    void* next_free_bp = 0;
-    if (free_listp == NULL)
+    void* prev_free_bp = GET_PRED(bp);
+    void* next_free_bp = GET_SUCC(bp);
+
+    if (prev_free_bp)
+        SET_SUCC(prev_free_bp, next_free_bp);
+    else
+        LIST_HEAD(GET_CLASS(HDRP(bp))) = LINK_OFF(next_free_bp);
+    if (next_free_bp)
+        SET_PRED(next_free_bp, prev_free_bp);
+    // mm_check(__FUNCTION__); // DEBUG
+}
+
+// Sampled from malloc/free: abort on corruption, so it is caught close to where it happened
+static void check_sample(void) {
+    if (--check_countdown > 0)
         return;
-    prev_free_bp = GET_PRED(bp);
-    next_free_bp = GET_SUCC(bp);
+    check_countdown = check_rate;
+    if (mm_check_step(check_budget) != 0)
+        abort();
+}
 
-    if (prev_free_bp == next_free_bp && prev_free_bp != 0) {
-        /*mm_check(__FUNCTION__);*/
-        /*printf("\nin delete from list: bp=%u, prev_free_bp=%u, next_free_bp=%u\n", (size_t)bp, prev_free_bp, next_free_bp);*/
+// Sample the checker every `rate` mallocs/frees (0: off), checking `budget` blocks each time
+void mm_check_config(unsigned rate, unsigned budget) {
+    check_rate = rate;
+    check_countdown = rate;
+    check_budget = budget ? budget : 1;
+}
+
+static int check_fail(const char* what, char* bp) {
+    fprintf(stderr, "mm_check_step: %s at block %p (heap %p-%p)\n", what, bp, mem_heap_lo(), mem_heap_hi());
+    return -1;
+}
+
+/*
+    Check the next `budget` blocks: size and bounds, free header/footer agreement, the next
+    block's prev_alloc bit and prev-free hint, no two adjacent free blocks, and the size class
+    and free-list links of free blocks.
+    Returns 0, or -1 after printing the first problem found.
+*/
+int mm_check_step(size_t budget) {
+    char* lo = mem_heap_lo();
+    char* hi = (char*)mem_heap_hi() + 1;
+    char* bp = check_cursor;
+    for (; budget > 0; budget--) {
+        if (bp == NULL || GET_SIZE(HDRP(bp)) == 0)  // Start over after the epilogue
+            bp = NEXT_BLKP(heap_listp);
+        if (GET_SIZE(HDRP(bp)) == 0)  // Empty heap
+            break;
+        size_t size = GET_SIZE(HDRP(bp));
+        char* next = NEXT_BLKP(bp);
+        if ((size_t)bp % WSIZE != 0 || size % WSIZE != 0 || size < MIN_BLK_SIZE || next > hi || HDRP(bp) < lo)
+            return check_fail("bad block size or address", bp);
+        if (GET_PREV_ALLOC(HDRP(next)) != GET_ALLOC(HDRP(bp)))
+            return check_fail("next block's prev_alloc bit disagrees", bp);
+        if (!GET_ALLOC(HDRP(bp))) {
+            char* pred = GET_PRED(bp);
+            char* succ = GET_SUCC(bp);
+            if ((GET(HDRP(bp)) & 0x1) != (GET(FTRP(bp)) & 0x1) || GET_SIZE(FTRP(bp)) != size)
+                return check_fail("free block header and footer disagree", bp);
+            if (!GET_ALLOC(HDRP(next)))
+                return check_fail("two adjacent free blocks", bp);
+            if (GET_HINT(HDRP(next)) != 0 && GET_HINT(HDRP(next)) != size)
+                return check_fail("next block's prev-free hint is stale", bp);
+            if (GET_CLASS(HDRP(bp)) != size_class(size))
+                return check_fail("wrong size class", bp);
+            if (pred == NULL ? LINK_PTR(LIST_HEAD(GET_CLASS(HDRP(bp)))) != bp : (pred < lo || pred >= hi || GET_SUCC(pred) != bp))
+                return check_fail("free-list pred link broken", bp);
+            if (succ != NULL && (succ < lo || succ >= hi || GET_PRED(succ) != bp))
+                return check_fail("free-list succ link broken", bp);
+        }
+        bp = next;
     }
-    if (prev_free_bp && next_free_bp) {  // 11
-        SET_SUCC(prev_free_bp, GET_SUCC(bp));
-        SET_PRED(next_free_bp, GET_PRED(bp));
-    } else if (prev_free_bp && !next_free_bp) {  // 10
-        SET_SUCC(prev_free_bp, 0);
-    } else if (!prev_free_bp && next_free_bp) {  // 01
-        SET_PRED(next_free_bp, 0);
-        free_listp = (void*)next_free_bp;
-    } else {  // 00
-        free_listp = NULL;
+    check_cursor = bp;
+    return 0;
+}
+
+// Walk every block in address order. Returns the number of allocated blocks, adds up free blocks and bytes if asked.
+size_t mm_walk(size_t* free_blocks, size_t* free_bytes) {
+    size_t used = 0, blocks = 0, bytes = 0;
+    for (char* bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) != 0; bp = NEXT_BLKP(bp)) {
+        if (GET_ALLOC(HDRP(bp))) {
+            used++;
+        } else {
+            blocks++;
+            bytes += GET_SIZE(HDRP(bp));
+        }
     }
-    // mm_check(__FUNCTION__); // DEBUG
+    if (free_blocks != NULL)
+        *free_blocks = blocks;
+    if (free_bytes != NULL)
+        *free_bytes = bytes;
+    return used;
 }
 
 void mm_check(const char* function) {
     printf("---cur func: %s :\n", function);
-    char* bp = free_listp;
     int count_empty_block = 0;
-    while (bp != NULL) {  // not end block;
-        count_empty_block++;
-        printf("addr_start：%zx, addr_end：%zx, size_head:%zu, size_foot:%zu, PRED=%zx, SUCC=%zx \n", (size_t)bp - WSIZE,
-               (size_t)FTRP(bp), GET_SIZE(HDRP(bp)), GET_SIZE(FTRP(bp)), GET_PRED(bp), GET_SUCC(bp));
-        ;
-        bp = (char*)GET_SUCC(bp);
+    for (int c = 0; c < CLASS_NUM; c++) {
+        char* bp = LINK_PTR(LIST_HEAD(c));
+        while (bp != NULL) {  // not end block;
+            count_empty_block++;
+            printf("class %d: addr_start：%zx, addr_end：%zx, size_head:%zu, size_foot:%zu, PRED=%zx, SUCC=%zx \n", c, (size_t)bp - WSIZE,
+                   (size_t)FTRP(bp), GET_SIZE(HDRP(bp)), GET_SIZE(FTRP(bp)), GET_PRED(bp), GET_SUCC(bp));
+            bp = (char*)GET_SUCC(bp);
+        }
     }
     printf("empty_block num: %d\n\n", count_empty_block);
 }
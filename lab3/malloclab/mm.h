@@ -10,6 +10,30 @@ extern void *mm_malloc (size_t size);
 extern void *mm_malloc_best (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern size_t mm_payload_size(void *ptr);
+
+/* Cross-thread free: only the owner thread allocates, any thread may free */
+extern void mm_set_owner(void);
+extern void mm_set_remote_free(int on);
+extern size_t mm_drain_remote(void);
+
+/* Incremental heap checker, bounded per call; sampled from malloc/free once configured */
+extern int mm_check_step(size_t budget);
+extern void mm_check_config(unsigned rate, unsigned budget);
+extern size_t mm_walk(size_t *free_blocks, size_t *free_bytes);
+
+/* Relocatable blocks: payload address may change at every mm_compact() */
+typedef size_t mm_handle_t;
+extern mm_handle_t mm_handle_alloc(size_t size);
+extern void *mm_handle_deref(mm_handle_t h);
+extern void mm_handle_free(mm_handle_t h);
+extern size_t mm_compact(void);
+
+/* Heap snapshots: save the whole heap to a file, map it back on the next start */
+extern void mm_set_root(void *ptr);
+extern void *mm_get_root(void);
+extern int mm_snapshot(const char *path);
+extern int mm_restore(const char *path, int relocatable);
 extern size_t user_malloc_size ;
 extern size_t heap_size ;
 
@@ -0,0 +1,29 @@
+#ifndef MM_PROBE_H
+#define MM_PROBE_H
+
+/*
+    USDT probes of provider "mm", for perf and bpftrace (see probes/).
+    With <sys/sdt.h> (systemtap-sdt-dev) each probe is a single nop plus an ELF note,
+    so a disabled probe costs nothing. Without it, or with -DMM_NO_PROBES, the
+    probes compile away and only their arguments are evaluated.
+*/
+#if defined(__has_include) && !defined(MM_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MM_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef MM_PROBES_ENABLED
+#define MM_PROBE1(name, a) DTRACE_PROBE1(mm, name, a)
+#define MM_PROBE2(name, a, b) DTRACE_PROBE2(mm, name, a, b)
+#define MM_PROBE3(name, a, b, c) DTRACE_PROBE3(mm, name, a, b, c)
+#define MM_PROBE_COUNT(counter) ((counter)++)  // Bookkeeping that only feeds a probe argument
+#else
+#define MM_PROBE1(name, a) ((void)(a))
+#define MM_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define MM_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define MM_PROBE_COUNT(counter) ((void)0)
+#endif
+
+#endif
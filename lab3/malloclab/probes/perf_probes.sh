@@ -0,0 +1,24 @@
+#! /bin/bash
+# Count allocator USDT events with perf stat.
+# Usage: probes/perf_probes.sh path/to/libmem.so command [args...]
+# e.g.   LD_LIBRARY_PATH=. probes/perf_probes.sh ./libmem.so ./workload workload.spec
+if [[ $# -lt 2 ]]; then
+    echo "Usage: $0 [libmem.so] [command...]"
+    exit 1
+fi
+LIB=$1
+shift
+EVENTS="malloc malloc_best free remote_free remote_drain find_fit coalesce extend_heap compact"
+
+# perf finds SDT notes through the build-id cache, then each one has to be turned into a probe
+sudo perf buildid-cache --add "$LIB" || exit 1
+list=""
+for ev in $EVENTS; do
+    sudo perf probe -q -d "sdt_mm:$ev" 2>/dev/null
+    sudo perf probe -q -x "$LIB" -a "sdt_mm:$ev" || exit 1
+    list="$list${list:+,}sdt_mm:$ev"
+done
+sudo -E perf stat -e "$list" -- "$@"
+for ev in $EVENTS; do
+    sudo perf probe -q -d "sdt_mm:$ev"
+done
@@ -1,15 +1,21 @@
 
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include "allocator.hpp"
 #include "config.h"
+#include "latency.hpp"
 #include "memlib.h"
 #include "mm.h"
+#include "fast_random.hpp"
+#include "workload_spec.hpp"
 #include "zipf.hpp"
 
 #define MAX_ITEMS 50000
@@ -17,10 +23,20 @@
 #define LOOP_NUM 20
 // #define LOOP_NUM 7
 #define SEED 10000
+#define READ_BATCH 4096  // Zipf samples drawn per batch in workload_read
+#define PREFETCH_DISTANCE 8  // Lookups prefetched ahead in READ_PREFETCH
+#define COMPARE_LOOP_NUM 5
+#define REMOTE_ITEMS 1000000  // Objects handed from the producer to the consumers in remote_free_run
+#define REMOTE_CONSUMERS 3
+#define STRESS_ITEMS 100000000L  // Objects at the largest stress_run scale (workload --stress [items])
+#define STRESS_SCALES 3          // stress_run also runs 1/10, 1/100, ... of the items
+#define STRESS_TYPES 6           // Only the sizes up to 64 bytes, so 100M objects fit in about 6GB
+#define FREE_ITEMS 100000  // Timed frees per coalesce case in free_run
+#define SNAPSHOT_PATH "./heap.snapshot"
 #define WORKLOAD_TYPE 16
-#define malloc mm_malloc
-// #define malloc mm_malloc_best
-#define free mm_free
+#define malloc hist_malloc
+// #define malloc hist_malloc_best
+#define free hist_free
 unsigned int workload_size[WORKLOAD_TYPE] = {12, 16, 24, 32, 48, 64, 96, 100, 128, 192, 256, 384, 500, 512, 768, 1024};
 
 extern size_t user_malloc_size;
@@ -31,32 +47,16 @@ struct workload_base {
     void** addr;
 };
 
+static xoshiro256ss string_rng(SEED);  // Reseeded next to every srand(SEED), so each phase is reproducible
+
 /*Generation of string with length*/
 char* gen_random_string(int length) {
-    int flag, i;
     char* string;
     if ((string = (char*)malloc(length)) == NULL) {
         std::cerr << "Malloc failed at genRandomString!" << std::endl;
         return NULL;
     }
-
-    for (i = 0; i < length - 1; i++) {
-        flag = rand() % 3;
-        switch (flag) {
-            case 0:
-                string[i] = 'A' + rand() % 26;
-                break;
-            case 1:
-                string[i] = 'a' + rand() % 26;
-                break;
-            case 2:
-                string[i] = '0' + rand() % 10;
-                break;
-            default:
-                string[i] = 'x';
-                break;
-        }
-    }
+    fill_random_alnum(string_rng, string, length - 1);
     string[length - 1] = '\0';
     return string;
 }
@@ -64,7 +64,9 @@ char* gen_random_string(int length) {
 /* Create the workload index */
 int workload_create(struct workload_base* workload) {
     srand(SEED);
+    string_rng.seed(SEED);
     mem_init();
+    mem_prefault_enable(1);  // Fault in upcoming heap extensions on a background thread
     if (mm_init() < 0) {
         fprintf(stderr, "mm_init failed.\n");
         return 0;
@@ -79,7 +81,7 @@ int workload_insert(struct workload_base* workload) {
     unsigned int size, total = 0;
     for (int i = 0; i < MAX_ITEMS; i++) {
         if (workload->addr[i] == 0) {
-            size = workload_size[rand() % WORKLOAD_TYPE];
+            size = workload_size[string_rng() % WORKLOAD_TYPE];
             workload->addr[i] = gen_random_string(size);
             total += size;
         }
@@ -98,14 +100,64 @@ int workload_swap(struct workload_base* workload) {
     return 0;
 }
 
-/* Read strings, at a zipfian distribution */
-int workload_read(struct workload_base* workload) {
+/* Read-phase access patterns */
+enum read_mode {
+    READ_ZIPF = 0,    // strcpy from zipf-chosen slots
+    READ_SEQUENTIAL,  // Scan the slots in index order
+    READ_CHASE,       // Each slot is chosen from the content of the previous string (dependent loads)
+    READ_PREFETCH,    // Zipf slots, prefetching PREFETCH_DISTANCE lookups ahead
+    READ_MODE_NUM
+};
+static const char* read_mode_names[READ_MODE_NUM] = {"zipf", "sequential", "pointer-chase", "zipf+prefetch"};
+static volatile char read_sink;  // Keeps the copies observable
+
+/* Read MAX_ITEMS * 10 strings in the given mode */
+long workload_read_mode(struct workload_base* workload, read_mode mode) {
     char reader[1025];
-    zipf_distribution<int, double> zipf(MAX_ITEMS - 1, 0.99);
+    int index[READ_BATCH];
+    long reads = (long)MAX_ITEMS * 10;
+    zipf_alias_distribution<int, double> zipf(MAX_ITEMS - 1, 0.99);
     std::mt19937 generator2(SEED);
-    for (int i = 0; i < MAX_ITEMS * 10; i++) {
-        strcpy(reader, (char*)workload->addr[zipf(generator2)]);
+    unsigned int next = 0;
+    switch (mode) {
+        case READ_ZIPF:
+        case READ_PREFETCH:
+            for (long i = 0; i < reads; i += READ_BATCH) {
+                int count = std::min<long>(READ_BATCH, reads - i);
+                zipf.generate(generator2, index, count);
+                for (int j = 0; j < count; j++) {
+                    if (mode == READ_PREFETCH && j + PREFETCH_DISTANCE < count) {
+                        if (j + 2 * PREFETCH_DISTANCE < count) {
+                            __builtin_prefetch(&workload->addr[index[j + 2 * PREFETCH_DISTANCE]]);
+                        }
+                        __builtin_prefetch(workload->addr[index[j + PREFETCH_DISTANCE]]);
+                    }
+                    strcpy(reader, (char*)workload->addr[index[j]]);
+                }
+            }
+            break;
+        case READ_SEQUENTIAL:
+            for (long i = 0; i < reads; i++) {
+                strcpy(reader, (char*)workload->addr[i % MAX_ITEMS]);
+            }
+            break;
+        case READ_CHASE:
+            for (long i = 0; i < reads; i++) {
+                strcpy(reader, (char*)workload->addr[next]);
+                next = (next * 2654435761u + (unsigned char)reader[0] + i) % MAX_ITEMS;  // + i: never settle into a short cycle
+            }
+            break;
+        default:
+            return 0;
     }
+    read_sink = reader[0];
+    return reads;
+}
+
+/* Read strings, at a zipfian distribution */
+int workload_read(struct workload_base* workload) {
+    workload_read_mode(workload, READ_ZIPF);
+    return 0;
 }
 
 /* Randomly delete 80% of strings */
@@ -137,7 +189,194 @@ void* workload_run(void* workload) {
         gettimeofday(&cur_time, NULL);
         long sec2 = cur_time.tv_sec, usec2 = cur_time.tv_usec;
         std::cout << "  time of loop " << loop << " : " << (sec2 - sec1) * 1000 + (usec2 - usec1) / 1000 << "ms" << std::endl;
+        latency_registry::instance().report(std::cout);
+        latency_registry::instance().reset();
+    }
+}
+
+/* Insert/delete loops through relocatable handles, compacting the heap after each delete */
+void handle_run() {
+    mm_handle_t* handles = new mm_handle_t[MAX_ITEMS]();
+    puts("Starting handle_run...");
+    mem_reset_brk();
+    mm_init();
+    srand(SEED);
+    string_rng.seed(SEED);
+    for (int loop = 0; loop < COMPARE_LOOP_NUM; loop++) {
+        for (int i = 0; i < MAX_ITEMS; i++) {
+            if (handles[i] == 0) {
+                unsigned int size = workload_size[rand() % WORKLOAD_TYPE];
+                handles[i] = mm_handle_alloc(size);
+                memset(mm_handle_deref(handles[i]), 'a' + i % 26, size);
+            }
+        }
+        for (int i = 0; i < MAX_ITEMS; i++) {
+            if (rand() % 5 != 0) {
+                mm_handle_free(handles[i]);
+                handles[i] = 0;
+            }
+        }
+        std::cout << "  after free: " << get_utilization();
+        size_t trimmed = mm_compact();
+        std::cout << "; after compact: " << get_utilization() << " (" << (trimmed >> 10) << "KB trimmed)" << std::endl;
+        for (int i = 0; i < MAX_ITEMS; i++) {  // Moved blocks must keep their content
+            if (handles[i] != 0 && *(char*)mm_handle_deref(handles[i]) != 'a' + i % 26) {
+                std::cerr << "handle " << handles[i] << " corrupted by mm_compact" << std::endl;
+                break;
+            }
+        }
+    }
+    delete[] handles;
+}
+
+static long elapsed_us(struct timeval* from) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - from->tv_sec) * 1000000 + (now.tv_usec - from->tv_usec);
+}
+
+static long elapsed_ms(struct timeval* from) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - from->tv_sec) * 1000 + (now.tv_usec - from->tv_usec) / 1000;
+}
+
+/* Build the string index, snapshot the heap, then warm start from the snapshot */
+void snapshot_run() {
+    struct timeval t;
+    puts("Starting snapshot_run...");
+    mem_reset_brk();
+    mm_init();
+    srand(SEED);
+    string_rng.seed(SEED);
+    gettimeofday(&t, NULL);
+    // The index keeps offsets from the heap start, so it stays usable if the heap is relocated
+    size_t* index = (size_t*)malloc(sizeof(size_t) * MAX_ITEMS);
+    unsigned long sum = 0;
+    for (int i = 0; i < MAX_ITEMS; i++) {
+        char* s = gen_random_string(workload_size[rand() % WORKLOAD_TYPE]);
+        index[i] = s - (char*)mem_heap_lo();
+        sum += s[0];
+    }
+    mm_set_root(index);
+    std::cout << "  insert: " << elapsed_ms(&t) << "ms" << std::endl;
+
+    gettimeofday(&t, NULL);
+    if (mm_snapshot(SNAPSHOT_PATH) != 0) {
+        std::cerr << "mm_snapshot failed" << std::endl;
+        return;
+    }
+    std::cout << "  snapshot: " << elapsed_ms(&t) << "ms" << std::endl;
+
+    // The old heap is still mapped in this process, so the restore has to relocate
+    gettimeofday(&t, NULL);
+    if (mm_restore(SNAPSHOT_PATH, 1) != 0) {
+        std::cerr << "mm_restore failed" << std::endl;
+        return;
+    }
+    index = (size_t*)mm_get_root();
+    unsigned long restored_sum = 0;
+    for (int i = 0; i < MAX_ITEMS; i++) {
+        restored_sum += ((char*)mem_heap_lo() + index[i])[0];
+    }
+    std::cout << "  restore + first touch: " << elapsed_ms(&t) << "ms" << (sum == restored_sum ? "" : " (checksum mismatch!)")
+              << ", util " << get_utilization() << std::endl;
+    for (int i = 0; i < MAX_ITEMS; i++) {  // The restored free lists must keep working
+        if (rand() % 5 != 0) {
+            free((char*)mem_heap_lo() + index[i]);
+        }
+    }
+    std::cout << "  after free: " << get_utilization() << std::endl;
+}
+
+/* Lay out the strings with each mm placement policy, then time every read mode over that layout */
+void read_run() {
+    static const char* policy_names[] = {"first-fit", "best-fit"};
+    static void* (*policy_malloc[])(size_t) = {mm_malloc, mm_malloc_best};
+    struct workload_base workload;
+    workload.addr = new void*[MAX_ITEMS]();
+    puts("Starting read_run...");
+    for (int p = 0; p < 2; p++) {
+        mem_reset_brk();
+        mm_init();
+        srand(SEED);
+        string_rng.seed(SEED);
+        // Fill, free 80% and refill, so the policy decides where the refilled strings land
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < MAX_ITEMS; i++) {
+                if (workload.addr[i] == 0) {
+                    unsigned int size = workload_size[string_rng() % WORKLOAD_TYPE];
+                    char* s = (char*)policy_malloc[p](size);
+                    fill_random_alnum(string_rng, s, size - 1);
+                    s[size - 1] = '\0';
+                    workload.addr[i] = s;
+                }
+            }
+            for (int i = 0; round == 0 && i < MAX_ITEMS; i++) {
+                if (rand() % 5 != 0) {
+                    mm_free(workload.addr[i]);
+                    workload.addr[i] = 0;
+                }
+            }
+        }
+        for (int m = 0; m < READ_MODE_NUM; m++) {
+            struct timeval t;
+            gettimeofday(&t, NULL);
+            long reads = workload_read_mode(&workload, (read_mode)m);
+            long us = std::max(elapsed_us(&t), 1L);
+            char line[128];
+            snprintf(line, sizeof(line), "  %-10s%-15s%8ldus %8.2f Mreads/s", policy_names[p], read_mode_names[m], us,
+                     (double)reads / us);
+            std::cout << line << std::endl;
+        }
+        memset(workload.addr, 0, sizeof(void*) * MAX_ITEMS);
     }
+    delete[] workload.addr;
+}
+
+/* Run insert/delete loops against one template allocator configuration */
+template <class A>
+void compare_run(const char* label) {
+    A* a = new A();
+    void** addr = new void*[MAX_ITEMS]();
+    struct timeval t1, t2;
+    srand(SEED);
+    string_rng.seed(SEED);
+    gettimeofday(&t1, NULL);
+    for (int loop = 0; loop < COMPARE_LOOP_NUM; loop++) {
+        for (int i = 0; i < MAX_ITEMS; i++) {
+            if (addr[i] == 0) {
+                unsigned int size = workload_size[rand() % WORKLOAD_TYPE];
+                addr[i] = a->allocate(size);
+                memset(addr[i], 'x', size);
+            }
+        }
+        for (int i = 0; i < MAX_ITEMS; i++) {
+            if (rand() % 5 != 0) {
+                a->deallocate(addr[i]);
+                addr[i] = 0;
+            }
+        }
+    }
+    gettimeofday(&t2, NULL);
+    char line[128];
+    snprintf(line, sizeof(line), "  %-30s%8ldms  util %.4f  heap %zuKB", label,
+             (t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_usec - t1.tv_usec) / 1000, a->utilization(), a->heap_size() >> 10);
+    std::cout << line << std::endl;
+    delete[] addr;
+    delete a;
+}
+
+/* Compare compile-time allocator configurations on the same request sequence */
+void compare_allocators() {
+    using namespace mm_template;
+    puts("Comparing template allocators...");
+    compare_run<Allocator<first_fit, single_list, 8> >("first-fit/single-list/8B");
+    compare_run<Allocator<best_fit, single_list, 8> >("best-fit/single-list/8B");
+    compare_run<Allocator<first_fit, geometric_classes<>, 8> >("first-fit/geometric/8B");
+    compare_run<Allocator<best_fit, geometric_classes<>, 8> >("best-fit/geometric/8B");
+    compare_run<Allocator<first_fit, geometric_classes<>, 4> >("first-fit/geometric/4B");
+    compare_run<Allocator<best_fit, geometric_classes<>, 4> >("best-fit/geometric/4B");
 }
 
 /* Run monitor */
@@ -156,9 +395,196 @@ void* monitor_run(void* argv) {
     fout.close();
 }
 
-int main() {
+/* Producer/consumer: the owner thread allocates, consumer threads free every REMOTE_CONSUMERS-th item */
+struct remote_free_state {
+    void** items;
+    std::atomic<long> published;
+    std::mutex* lock;  // Global allocator lock, NULL to use the remote-free queues
+};
+
+static void* remote_consumer(void* arg) {
+    remote_free_state* st = ((std::pair<remote_free_state*, long>*)arg)->first;
+    long id = ((std::pair<remote_free_state*, long>*)arg)->second;
+    for (long i = id; i < REMOTE_ITEMS; i += REMOTE_CONSUMERS) {
+        while (st->published.load(std::memory_order_acquire) <= i) {
+            sched_yield();
+        }
+        if (st->lock) {
+            std::lock_guard<std::mutex> guard(*st->lock);
+            free(st->items[i]);
+        } else {
+            free(st->items[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Compare lock-free remote frees against one global lock around every allocator call */
+void remote_free_run() {
+    static const char* names[2] = {"remote-free queues", "global lock"};
+    puts("Starting remote_free_run...");
+    for (int locked = 0; locked < 2; locked++) {
+        std::mutex lock;
+        remote_free_state st;
+        st.items = new void*[REMOTE_ITEMS];
+        st.published.store(0);
+        st.lock = locked ? &lock : NULL;
+        mem_reset_brk();
+        mm_init();
+        mm_set_remote_free(!locked);
+        string_rng.seed(SEED);
+
+        struct timeval t;
+        gettimeofday(&t, NULL);
+        pthread_t tids[REMOTE_CONSUMERS];
+        std::pair<remote_free_state*, long> args[REMOTE_CONSUMERS];
+        for (long c = 0; c < REMOTE_CONSUMERS; c++) {
+            args[c] = std::make_pair(&st, c);
+            pthread_create(&tids[c], NULL, remote_consumer, &args[c]);
+        }
+        for (long i = 0; i < REMOTE_ITEMS; i++) {
+            unsigned int size = workload_size[string_rng() % WORKLOAD_TYPE];
+            if (locked) {
+                std::lock_guard<std::mutex> guard(lock);
+                st.items[i] = malloc(size);
+            } else {
+                st.items[i] = malloc(size);
+            }
+            memset(st.items[i], 'r', size);
+            st.published.store(i + 1, std::memory_order_release);
+        }
+        for (int c = 0; c < REMOTE_CONSUMERS; c++) {
+            pthread_join(tids[c], NULL);
+        }
+        mm_drain_remote();
+        long ms = std::max(elapsed_ms(&t), 1L);
+        char line[128];
+        snprintf(line, sizeof(line), "  %-20s%8ldms %8.2f Mops/s  heap %zuKB  util after drain %.4f", names[locked], ms,
+                 2.0 * REMOTE_ITEMS / ms / 1000, mem_heapsize() >> 10, get_utilization());
+        std::cout << line << std::endl;
+        delete[] st.items;
+    }
+    mm_set_remote_free(1);
+}
+
+/*
+    Average cycles of one mm_free for each coalesce case. Blocks are laid out in triples and the
+    middle one is timed after freeing none, one or both of its neighbours.
+*/
+void free_run() {
+    static const char* names[] = {"no merge", "merge prev", "merge next", "merge both"};
+    void** blocks = new void*[3 * FREE_ITEMS];
+    puts("Starting free_run...");
+    for (int c = 0; c < 4; c++) {  // c: neighbours freed first, bit 0 prev, bit 1 next
+        mem_reset_brk();
+        mm_init();
+        for (long i = 0; i < 3 * FREE_ITEMS; i++) {
+            blocks[i] = mm_malloc(100);
+        }
+        for (long i = 0; i < FREE_ITEMS; i++) {
+            if (c & 1) {
+                mm_free(blocks[3 * i]);
+            }
+            if (c & 2) {
+                mm_free(blocks[3 * i + 2]);
+            }
+        }
+        uint64_t start = latency_now();
+        for (long i = 0; i < FREE_ITEMS; i++) {
+            mm_free(blocks[3 * i + 1]);
+        }
+        uint64_t cycles = latency_now() - start;
+        char line[128];
+        snprintf(line, sizeof(line), "  %-22s%8.1f cycles/free", names[c], (double)cycles / FREE_ITEMS);
+        std::cout << line << std::endl;
+    }
+    delete[] blocks;
+}
+
+/*
+    Scale-out check at 1/100, 1/10 and all of `items` objects: allocation, heap-walk and free
+    time per object, and allocator overhead per object (heap bytes not requested). All of them
+    should stay flat as the heap grows to tens of GB.
+*/
+void stress_run(long items) {
+    long n = items;
+    for (int s = 1; s < STRESS_SCALES; s++) {
+        n /= 10;
+    }
+    n = std::max(1L, n);  // Small item counts run fewer scales instead of starting at 0
+    puts("Starting stress_run...");
+    printf("  %12s%14s%14s%14s%12s%16s\n", "objects", "alloc ns/obj", "walk ns/blk", "free ns/obj", "heap MB", "overhead B/obj");
+    for (; n <= items; n *= 10) {
+        void** addr = new void*[n];
+        size_t requested = 0;
+        mem_reset_brk();
+        mm_init();
+        string_rng.seed(SEED);
+        struct timeval t;
+        gettimeofday(&t, NULL);
+        for (long i = 0; i < n; i++) {
+            unsigned int size = workload_size[string_rng() % STRESS_TYPES];
+            if ((addr[i] = mm_malloc(size)) == NULL) {
+                fprintf(stderr, "  out of memory after %ld objects\n", i);
+                delete[] addr;
+                return;
+            }
+            requested += size;
+        }
+        long alloc_us = elapsed_us(&t);
+        size_t heap = mem_heapsize();
+
+        gettimeofday(&t, NULL);
+        size_t used = mm_walk(NULL, NULL);
+        long walk_us = elapsed_us(&t);
+
+        gettimeofday(&t, NULL);
+        for (long i = 0; i < n; i++) {
+            mm_free(addr[i]);
+        }
+        long free_us = elapsed_us(&t);
+        printf("  %12ld%14.1f%14.1f%14.1f%12zu%16.1f\n", n, alloc_us * 1000.0 / n, used ? walk_us * 1000.0 / used : 0.0,
+               free_us * 1000.0 / n, heap >> 20, (double)(heap - requested) / n);
+        delete[] addr;
+    }
+}
+
+/* Run a workload description file instead of the built-in phases */
+int spec_run(const char* path) {
+    workload_spec spec;
+    if (!spec.load(path)) {
+        return 1;
+    }
+    workload_ops ops = {hist_malloc, hist_free, hist_realloc, get_utilization, false};
+    mem_init();
+    mem_prefault_enable(1);
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed.\n");
+        return 1;
+    }
+    mm_set_remote_free(0);  // The driver already serializes every call, so its threads may free directly
+    printf("Running %s...\n", path);
+    spec.run(ops);
+    latency_registry::instance().report(std::cout);
+    return 0;
+}
+
+int main(int argc, char** argv) {
     int error;
     struct workload_base workload;
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0) {
+        long items = argc > 2 ? atol(argv[2]) : STRESS_ITEMS;
+        if (items <= 0) {
+            fprintf(stderr, "--stress needs a positive object count, got '%s'.\n", argv[2]);
+            return 1;
+        }
+        mem_init();
+        stress_run(items);
+        return 0;
+    }
+    if (argc > 1) {
+        return spec_run(argv[1]);
+    }
     if (error = workload_create(&workload)) {
         std::cerr << "workload creat error:" << error << std::endl;
     }
@@ -167,5 +593,11 @@ int main() {
     // pthread_create(&monitor_pid, NULL, monitor_run, NULL);
     workload_run(&workload);
     // pthread_cancel(monitor_pid);
+    read_run();
+    free_run();
+    remote_free_run();
+    handle_run();
+    snapshot_run();
+    compare_allocators();
     return 0;
 }
@@ -0,0 +1,10 @@
+# Default workload_run traffic: see workload_spec.hpp for the format
+items 50000
+loops 20
+threads 1
+seed 10000
+sizes 12 16 24 32 48 64 96 100 128 192 256 384 500 512 768 1024
+phase insert
+phase swap
+phase read 10 zipf 0.99
+phase delete 0.8
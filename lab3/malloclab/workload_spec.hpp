@@ -0,0 +1,481 @@
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fast_random.hpp"
+#include "zipf.hpp"
+
+/** Multi-phase workload description, read from a text file.
+ *
+ * One directive per line, '#' starts a comment:
+ *
+ *     items 50000            # number of string slots
+ *     loops 20               # times the phase list is run
+ *     threads 1              # slots are split evenly between threads
+ *     seed 10000
+ *     sizes 12 16 24:2 1024  # string sizes, size:weight (default weight 1)
+ *     phase insert [fill]    # fill empty slots up to fill * items (default 1.0)
+ *     phase swap             # move every slot down by one
+ *     phase read N [zipf q | seq]  # N * items strcpy reads (default zipf 0.99)
+ *     phase delete ratio     # free each string with probability ratio
+ *     phase sleep ms
+ *     phase grow count max   # count buffers appended to round-robin, capacity doubled by resize, up to max bytes
+ *     phase churn temps      # per slot: temps short-lived strings around one long-lived insert
+ *     phase handoff count    # count strings released by a consumer thread, not the allocating one
+ *
+ * The file is parsed once; the driver then runs the phase list without any
+ * further lookups, so its overhead is one switch per phase.
+ */
+struct workload_ops {
+    void* (*alloc)(size_t);
+    void (*release)(void*);
+    void* (*resize)(void*, size_t);
+    double (*utilization)();  // NULL if the allocator has no such counter
+    bool thread_safe;         // If not, alloc/release are serialized by the driver
+};
+
+class workload_spec
+{
+public:
+    enum phase_type { PHASE_INSERT, PHASE_SWAP, PHASE_READ, PHASE_DELETE, PHASE_SLEEP, PHASE_GROW, PHASE_CHURN, PHASE_HANDOFF };
+
+    struct phase {
+        phase_type type;
+        double arg;   // fill, reads per item, delete ratio, milliseconds or count
+        double q;     // zipf exponent, 0 for a sequential read
+        long limit;   // grow: buffer size limit
+        std::string text;
+    };
+
+    long items = 50000;
+    int loops = 1;
+    int threads = 1;
+    unsigned long seed = 10000;
+    std::vector<unsigned int> size_table;  // Sizes repeated by weight, picked uniformly
+    std::vector<phase> phases;
+
+    /** Parse a description file, returns false (with a message on stderr) on error */
+    bool load(const char* path)
+    {
+        std::ifstream in(path);
+        if (!in) {
+            std::cerr << path << ": cannot open workload description" << std::endl;
+            return false;
+        }
+        std::string line;
+        for (int lineno = 1; std::getline(in, line); lineno++) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream words(line);
+            std::string key;
+            if (!(words >> key)) {
+                continue;
+            }
+            if (!parse(key, words, line)) {
+                std::cerr << path << ":" << lineno << ": bad directive: " << line << std::endl;
+                return false;
+            }
+        }
+        if (size_table.empty() || phases.empty() || items <= 0 || loops <= 0 || threads <= 0 || threads > items) {
+            std::cerr << path << ": needs sizes, at least one phase, and positive items/loops/threads" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /** Run the description on ops, printing the time spent in each phase */
+    void run(const workload_ops& ops)
+    {
+        this->ops = ops;
+        addr.assign(items, (char*)0);
+        phase_us.assign(phases.size(), 0);
+        struct timeval t1, t2;
+        gettimeofday(&t1, NULL);
+        std::vector<pthread_t> tids(threads);
+        std::vector<worker_arg> args(threads);
+        for (int t = 0; t < threads; t++) {
+            args[t].spec = this;
+            args[t].id = t;
+            pthread_create(&tids[t], NULL, worker_main, &args[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        gettimeofday(&t2, NULL);
+
+        char line[160];
+        for (size_t p = 0; p < phases.size(); p++) {
+            snprintf(line, sizeof(line), "  %-32s%10.1fms per loop", phases[p].text.c_str(),
+                     phase_us[p] / 1000.0 / loops / threads);
+            std::cout << line << std::endl;
+        }
+        std::cout << "  total: " << (t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_usec - t1.tv_usec) / 1000 << "ms";
+        if (ops.utilization) {
+            std::cout << ", util " << ops.utilization();
+        }
+        std::cout << std::endl;
+        for (long i = 0; i < items; i++) {
+            if (addr[i]) {
+                release(addr[i]);
+            }
+        }
+    }
+
+private:
+    struct worker_arg {
+        workload_spec* spec;
+        int id;
+    };
+
+    bool parse(const std::string& key, std::istringstream& words, const std::string& line)
+    {
+        if (key == "items") {
+            return (bool)(words >> items);
+        } else if (key == "loops") {
+            return (bool)(words >> loops);
+        } else if (key == "threads") {
+            return (bool)(words >> threads);
+        } else if (key == "seed") {
+            return (bool)(words >> seed);
+        } else if (key == "sizes") {
+            std::string word;
+            while (words >> word) {
+                unsigned int size = 0, weight = 1;
+                if (sscanf(word.c_str(), "%u:%u", &size, &weight) < 1 || size < 2 || weight == 0) {
+                    return false;
+                }
+                size_table.insert(size_table.end(), weight, size);
+            }
+            return !size_table.empty();
+        } else if (key != "phase") {
+            return false;
+        }
+
+        std::string name;
+        phase p = {PHASE_SWAP, 0, 0, 0, line.substr(line.find_first_not_of(" \t"))};
+        p.text = p.text.substr(0, p.text.find_last_not_of(" \t") + 1);
+        if (!(words >> name)) {
+            return false;
+        }
+        if (name == "insert") {
+            double fill;
+            p.type = PHASE_INSERT;
+            p.arg = words >> fill ? fill : 1.0;
+        } else if (name == "swap") {
+            p.type = PHASE_SWAP;
+        } else if (name == "read") {
+            std::string mode = "zipf";
+            p.type = PHASE_READ;
+            p.q = 0.99;
+            if (!(words >> p.arg)) {
+                return false;
+            }
+            double q;
+            words >> mode;
+            if (mode == "seq") {
+                p.q = 0;
+            } else if (mode != "zipf") {
+                return false;
+            } else if (words >> q) {
+                if (q <= 0) {
+                    return false;
+                }
+                p.q = q;
+            }
+        } else if (name == "delete") {
+            p.type = PHASE_DELETE;
+            if (!(words >> p.arg) || p.arg < 0 || p.arg > 1) {
+                return false;
+            }
+        } else if (name == "sleep") {
+            p.type = PHASE_SLEEP;
+            if (!(words >> p.arg)) {
+                return false;
+            }
+        } else if (name == "grow") {
+            p.type = PHASE_GROW;
+            if (!(words >> p.arg >> p.limit) || p.arg < 1 || p.limit < 1) {
+                return false;
+            }
+        } else if (name == "churn") {
+            p.type = PHASE_CHURN;
+            if (!(words >> p.arg) || p.arg < 0 || p.arg > CHURN_MAX) {
+                return false;
+            }
+        } else if (name == "handoff") {
+            p.type = PHASE_HANDOFF;
+            if (!(words >> p.arg) || p.arg < 0) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        phases.push_back(p);
+        return true;
+    }
+
+    static void* worker_main(void* arg)
+    {
+        worker_arg* w = (worker_arg*)arg;
+        w->spec->work(w->id);
+        return NULL;
+    }
+
+    /** Thread id runs every loop on its own slice [lo, hi) of the slots */
+    void work(int id)
+    {
+        const long lo = items * id / threads, hi = items * (id + 1) / threads, n = hi - lo;
+        char** slot = &addr[lo];
+        xoshiro256ss rng(seed + id);
+        std::vector<zipf_alias_distribution<long, double>*> zipf(phases.size(), (zipf_alias_distribution<long, double>*)0);
+        for (size_t p = 0; p < phases.size(); p++) {
+            if (phases[p].type == PHASE_READ && phases[p].q > 0) {  // Build the alias tables before timing
+                zipf[p] = new zipf_alias_distribution<long, double>(n, phases[p].q);
+            }
+        }
+        std::vector<long> index(READ_BATCH);
+        char reader[1025];
+        unsigned long sink = 0;
+
+        for (int loop = 0; loop < loops; loop++) {
+            for (size_t p = 0; p < phases.size(); p++) {
+                const phase& ph = phases[p];
+                struct timeval t1, t2;
+                gettimeofday(&t1, NULL);
+                switch (ph.type) {
+                    case PHASE_INSERT:
+                        for (long i = 0; i < (long)(n * ph.arg) && i < n; i++) {
+                            if (slot[i] == 0) {
+                                slot[i] = new_string(rng);
+                            }
+                        }
+                        break;
+                    case PHASE_SWAP:
+                        for (long i = 1; i < n; i++) {
+                            std::swap(slot[i], slot[i - 1]);
+                        }
+                        break;
+                    case PHASE_READ: {
+                        const long reads = (long)(n * ph.arg);
+                        for (long i = 0; i < reads; i += READ_BATCH) {
+                            const long count = std::min<long>(READ_BATCH, reads - i);
+                            if (zipf[p]) {
+                                zipf[p]->generate(rng, index.data(), count);
+                            } else {
+                                for (long j = 0; j < count; j++) {
+                                    index[j] = (i + j) % n + 1;
+                                }
+                            }
+                            for (long j = 0; j < count; j++) {
+                                const char* s = slot[index[j] - 1];
+                                if (s) {
+                                    strcpy(reader, s);
+                                    sink += reader[0];
+                                }
+                            }
+                        }
+                        break;
+                    }
+                    case PHASE_DELETE: {
+                        const uint64_t threshold = (uint64_t)(ph.arg * 18446744073709551615.0);
+                        for (long i = 0; i < n; i++) {
+                            if (slot[i] && (ph.arg >= 1 || rng() < threshold)) {
+                                release(slot[i]);
+                                slot[i] = 0;
+                            }
+                        }
+                        break;
+                    }
+                    case PHASE_SLEEP:
+                        usleep((useconds_t)(ph.arg * 1000));
+                        break;
+                    case PHASE_GROW:
+                        grow(rng, (long)ph.arg, ph.limit);
+                        break;
+                    case PHASE_CHURN:
+                        churn(rng, slot, n, (int)ph.arg);
+                        break;
+                    case PHASE_HANDOFF:
+                        handoff(rng, (long)ph.arg);
+                        break;
+                }
+                gettimeofday(&t2, NULL);
+                __atomic_fetch_add(&phase_us[p], (t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec),
+                                   __ATOMIC_RELAXED);
+            }
+        }
+        for (size_t p = 0; p < zipf.size(); p++) {
+            delete zipf[p];
+        }
+        read_sink = sink;
+    }
+
+    /** A NUL-terminated random string with a size from the size table */
+    char* new_string(xoshiro256ss& rng)
+    {
+        unsigned int size = size_table[rng() % size_table.size()];
+        char* s = (char*)alloc(size);
+        if (s == NULL) {
+            std::cerr << "alloc failed" << std::endl;
+            return NULL;
+        }
+        fill_random_alnum(rng, s, size - 1);
+        s[size - 1] = '\0';
+        return s;
+    }
+
+    /** Vector-style buffers: append 16-64 byte pieces round-robin, doubling a buffer's capacity when it is full */
+    void grow(xoshiro256ss& rng, long count, long limit)
+    {
+        std::vector<char*> buf(count);
+        std::vector<long> len(count, 0), cap(count, 16);
+        for (long b = 0; b < count; b++) {
+            buf[b] = (char*)alloc(cap[b]);
+        }
+        for (bool growing = true; growing;) {
+            growing = false;
+            for (long b = 0; b < count; b++) {
+                if (buf[b] == NULL || len[b] >= limit) {
+                    continue;
+                }
+                long piece = 16 + rng() % 49;
+                if (len[b] + piece > cap[b]) {
+                    long new_cap = cap[b];
+                    while (len[b] + piece > new_cap) {
+                        new_cap *= 2;
+                    }
+                    char* bigger = (char*)resize(buf[b], new_cap);
+                    if (bigger == NULL) {
+                        // buf[b] still has the old capacity; stop growing it rather than overrun it later
+                        std::cerr << "resize failed" << std::endl;
+                        len[b] = limit;
+                        continue;
+                    }
+                    if (bigger[0] != 'g' && len[b] > 0) {
+                        std::cerr << "resize lost the buffer contents" << std::endl;
+                    }
+                    buf[b] = bigger;
+                    cap[b] = new_cap;
+                }
+                memset(buf[b] + len[b], 'g', piece);
+                len[b] += piece;
+                growing = true;
+            }
+        }
+        for (long b = 0; b < count; b++) {
+            if (buf[b]) {
+                release(buf[b]);
+            }
+        }
+    }
+
+    /** Mixed lifetimes: temps temporaries are allocated and freed around each long-lived slot insert,
+     * so the survivors end up between the holes the temporaries leave */
+    void churn(xoshiro256ss& rng, char** slot, long n, int temps)
+    {
+        char* temp[CHURN_MAX];
+        for (long i = 0; i < n; i++) {
+            for (int t = 0; t < temps; t++) {
+                temp[t] = new_string(rng);
+            }
+            if (slot[i] == 0) {
+                slot[i] = new_string(rng);
+            }
+            for (int t = temps - 1; t >= 0; t--) {
+                if (temp[t]) {
+                    release(temp[t]);
+                }
+            }
+        }
+    }
+
+    /** Producer/consumer: this thread allocates, a consumer thread frees */
+    void handoff(xoshiro256ss& rng, long count)
+    {
+        std::deque<char*> queue;
+        std::mutex queue_lock;
+        std::condition_variable ready;
+        bool done = false;
+        std::thread consumer([&]() {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            while (true) {
+                ready.wait(guard, [&]() { return !queue.empty() || done; });
+                if (queue.empty()) {
+                    return;
+                }
+                char* s = queue.front();
+                queue.pop_front();
+                guard.unlock();
+                release(s);
+                guard.lock();
+            }
+        });
+        for (long i = 0; i < count; i++) {
+            char* s = new_string(rng);
+            if (s == NULL) {
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(queue_lock);
+            queue.push_back(s);
+            ready.notify_one();
+        }
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            done = true;
+            ready.notify_one();
+        }
+        consumer.join();
+    }
+
+    void* alloc(size_t size)
+    {
+        if (ops.thread_safe) {
+            return ops.alloc(size);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        return ops.alloc(size);
+    }
+
+    void* resize(void* ptr, size_t size)
+    {
+        if (ops.thread_safe) {
+            return ops.resize(ptr, size);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        return ops.resize(ptr, size);
+    }
+
+    void release(void* ptr)
+    {
+        if (ops.thread_safe) {
+            ops.release(ptr);
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        ops.release(ptr);
+    }
+
+    enum { READ_BATCH = 4096 };  // Zipf samples drawn at a time
+    enum { CHURN_MAX = 64 };     // Most temporaries per churn step
+
+    workload_ops ops;
+    std::mutex lock;
+    std::vector<char*> addr;
+    std::vector<long> phase_us;  // Summed over threads and loops
+    volatile unsigned long read_sink;
+};
@@ -1,9 +1,11 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <algorithm>
 #include <cmath>
 #include <random>
+#include <vector>
 
 /** Zipf-like random distribution.
  *
@@ -100,4 +102,112 @@ private:
     RealType                                 H_x1;  ///< H(x_1)
     RealType                                 H_n;   ///< H(n)
     std::uniform_real_distribution<RealType> dist;  ///< [H(x_1), H(n)]
-};
\ No newline at end of file
+};
+
+/** Zipf distribution over [1, n] sampled from a Walker/Vose alias table.
+ *
+ * Building the table is O(n) time and memory, after which every sample is
+ * two 32-bit draws, one multiply and one table lookup, with no libm calls.
+ * Probabilities are quantized to 32 bits. Use zipf_distribution for
+ * unbounded n.
+ *
+ * "A linear algorithm for generating random numbers with a given
+ * distribution", Michael D. Vose, IEEE TSE 17.9 (1991): 972-975
+ */
+template<class IntType = unsigned long, class RealType = double>
+class zipf_alias_distribution
+{
+public:
+    typedef RealType input_type;
+    typedef IntType result_type;
+
+    static_assert(std::numeric_limits<IntType>::is_integer, "");
+    static_assert(!std::numeric_limits<RealType>::is_integer, "");
+
+    zipf_alias_distribution(const IntType n, const RealType q=1.0)
+        : n(n)
+        , prob(n)
+        , alias(n)
+    {
+        std::vector<RealType> p(n);
+        RealType sum = 0;
+        for (IntType k = 0; k < n; k++) {
+            p[k] = std::pow(k + 1.0, -q);
+            sum += p[k];
+        }
+
+        // Scale to mean 1, then pair each underfull column with an overfull one
+        std::vector<IntType> small, large;
+        for (IntType k = 0; k < n; k++) {
+            p[k] *= n / sum;
+            alias[k] = k;
+            (p[k] < 1.0 ? small : large).push_back(k);
+        }
+        while (!small.empty() && !large.empty()) {
+            const IntType s = small.back(), l = large.back();
+            small.pop_back();
+            prob[s] = threshold(p[s]);
+            alias[s] = l;
+            p[l] -= 1.0 - p[s];
+            if (p[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Whatever is left is full up to rounding error
+        for (IntType k : small) {
+            prob[k] = UINT32_MAX;
+        }
+        for (IntType k : large) {
+            prob[k] = UINT32_MAX;
+        }
+    }
+
+    template<class URNG>
+    IntType operator()(URNG& rng)
+    {
+        const uint32_t u = static_cast<uint32_t>(rng());
+        const uint32_t v = static_cast<uint32_t>(rng());
+        return pick(u, v);
+    }
+
+    /** Fill out[0, count) with samples. The random words are drawn first so
+     * the table lookups form a branch-free loop the compiler can vectorize.
+     */
+    template<class URNG>
+    void generate(URNG& rng, IntType* out, size_t count)
+    {
+        uint32_t u[BATCH], v[BATCH];
+        while (count > 0) {
+            const size_t len = count < BATCH ? count : BATCH;  // Not std::min: that odr-uses BATCH before C++17
+            for (size_t i = 0; i < len; i++) {
+                u[i] = static_cast<uint32_t>(rng());
+                v[i] = static_cast<uint32_t>(rng());
+            }
+            for (size_t i = 0; i < len; i++) {
+                out[i] = pick(u[i], v[i]);
+            }
+            out += len;
+            count -= len;
+        }
+    }
+
+private:
+    static constexpr size_t BATCH = 256;
+
+    /** Column from u (multiply-shift, no modulo), then the column itself or its alias by v. */
+    IntType pick(const uint32_t u, const uint32_t v) const
+    {
+        const IntType k = static_cast<IntType>(((uint64_t)u * n) >> 32);
+        return (v < prob[k] ? k : alias[k]) + 1;
+    }
+
+    static uint32_t threshold(const RealType p)
+    {
+        return static_cast<uint32_t>(std::min<RealType>(p * 4294967296.0, UINT32_MAX));
+    }
+
+    IntType               n;      ///< Number of elements
+    std::vector<uint32_t> prob;   ///< Chance (of 2^32) to keep column k
+    std::vector<IntType>  alias;  ///< Element taken otherwise
+};
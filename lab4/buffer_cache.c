@@ -0,0 +1,480 @@
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include "fat16.h"
+
+/*
+ * 扇区缓冲区缓存（write-back）：按扇区号缓存最近使用的 BCACHE_SECTORS 个扇区。
+ * 读命中直接从内存返回；写只修改缓存并标记为脏，在需要淘汰脏扇区、bcache_flush()
+ * 或后台线程每 BCACHE_FLUSH_SEC 秒一次的定时刷新时才按扇区号顺序写回磁盘。
+ * 淘汰策略为 LRU。所有操作由 bc.lock 保护，可被多个线程调用。
+ *
+ * 读盘时不持有 bc.lock：正在读入的项标记为 loading，其它线程访问它时在 io_cond 上等待；
+ * 被 pin 住（正在被读入或拷贝）的项不会被淘汰。写回时同样不持有 bc.lock：正在写回的项标记为
+ * writing，写入它的线程等待写回完成，它也不会被淘汰；同一时刻只有一个线程在写回（bc.flushing）。
+ * bcache_prefetch() 把预读请求放入队列，由后台预读线程异步读入缓存。
+ */
+
+#define BCACHE_NONE ((uint32_t)-1)  // 空链接
+#define BCACHE_RUN  256                // 一次连续读写的最大扇区数
+#define BCACHE_RA_QUEUE 64             // 预读请求队列长度，队列满时丢弃新的请求
+
+typedef struct {
+    sector_t sector;
+    uint32_t prev, next;   // LRU 双向链表，表头为最近使用
+    uint32_t hash_next;    // 哈希桶链表
+    uint32_t pins;         // 正在使用该项的线程数，大于 0 时不可淘汰
+    bool hashed;           // 在哈希桶链表中。读入失败的项 valid 为 false，但仍在链表中
+    bool valid;
+    bool dirty;
+    bool loading;          // 正在从磁盘读入
+    bool writing;          // 正在写回磁盘，写回完成前不可修改
+    char data[PHYSICAL_SECTOR_SIZE];
+} BufferEntry;
+
+typedef struct {
+    sector_t start;
+    size_t count;
+} PrefetchRequest;
+
+static struct {
+    BufferEntry* entries;
+    uint32_t* buckets;
+    uint32_t* order;        // flush 时按扇区号排序的脏项
+    struct iovec* iov;      // flush 时每个脏扇区的 iovec
+    DiskIO* ios;            // flush 时提交的一批写请求
+    uint32_t nbuckets;      // 2 的幂
+    uint32_t lru_head, lru_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t stop_cond;
+    pthread_cond_t io_cond;     // 有项读入或写回完成，或者不再被 pin 住
+    pthread_cond_t ra_cond;     // 有新的预读请求
+    pthread_t flusher, prefetcher;
+    bool running, prefetching;
+    bool flushing;              // 有线程正在写回，order、iov、ios 归它使用
+    PrefetchRequest ra_queue[BCACHE_RA_QUEUE];
+    uint32_t ra_head, ra_len;
+    unsigned long hits, misses, writebacks, prefetched;
+} bc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .stop_cond = PTHREAD_COND_INITIALIZER,
+    .io_cond = PTHREAD_COND_INITIALIZER,
+    .ra_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint32_t bucket_of(sector_t sec) {
+    return (uint32_t)(sec * 0x9E3779B97F4A7C15ull >> 32) & (bc.nbuckets - 1);
+}
+
+static void lru_unlink(uint32_t i) {
+    BufferEntry* e = &bc.entries[i];
+    if (e->prev != BCACHE_NONE) bc.entries[e->prev].next = e->next; else bc.lru_head = e->next;
+    if (e->next != BCACHE_NONE) bc.entries[e->next].prev = e->prev; else bc.lru_tail = e->prev;
+}
+
+static void lru_push_front(uint32_t i) {
+    BufferEntry* e = &bc.entries[i];
+    e->prev = BCACHE_NONE;
+    e->next = bc.lru_head;
+    if (bc.lru_head != BCACHE_NONE) bc.entries[bc.lru_head].prev = i; else bc.lru_tail = i;
+    bc.lru_head = i;
+}
+
+static uint32_t lookup(sector_t sec) {
+    for (uint32_t i = bc.buckets[bucket_of(sec)]; i != BCACHE_NONE; i = bc.entries[i].hash_next) {
+        if (bc.entries[i].sector == sec) {
+            return i;
+        }
+    }
+    return BCACHE_NONE;
+}
+
+static void hash_remove(uint32_t i) {
+    uint32_t* p = &bc.buckets[bucket_of(bc.entries[i].sector)];
+    while (*p != i) {
+        p = &bc.entries[*p].hash_next;
+    }
+    *p = bc.entries[i].hash_next;
+}
+
+static int cmp_sector(const void* a, const void* b) {
+    sector_t x = bc.entries[*(const uint32_t*)a].sector, y = bc.entries[*(const uint32_t*)b].sector;
+    return x < y ? -1 : x > y;
+}
+
+// 写回所有脏扇区。需持有锁，写盘时会释放锁。
+static int flush_locked(void) {
+    while (bc.flushing) {
+        pthread_cond_wait(&bc.io_cond, &bc.lock);
+    }
+    // 扇区号连续的脏扇区合并为一个请求，所有请求作为一批交给磁盘调度器排序写回，减少磁头移动
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < BCACHE_SECTORS; i++) {
+        if (bc.entries[i].valid && bc.entries[i].dirty) {
+            bc.order[n++] = i;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    qsort(bc.order, n, sizeof(uint32_t), cmp_sector);
+    int nios = 0;
+    for (uint32_t k = 0; k < n;) {
+        sector_t start = bc.entries[bc.order[k]].sector;
+        int cnt = 0;
+        while (k + cnt < n && cnt < BCACHE_RUN && bc.entries[bc.order[k + cnt]].sector == start + cnt) {
+            bc.iov[k + cnt].iov_base = bc.entries[bc.order[k + cnt]].data;
+            bc.iov[k + cnt].iov_len = PHYSICAL_SECTOR_SIZE;
+            cnt++;
+        }
+        bc.ios[nios++] = (DiskIO){ .start = start, .iov = &bc.iov[k], .iovcnt = cnt, .write = true };
+        k += cnt;
+    }
+    for (uint32_t k = 0; k < n; k++) {
+        bc.entries[bc.order[k]].writing = true;
+    }
+    bc.flushing = true;
+    pthread_mutex_unlock(&bc.lock);
+    int err = sectors_submit(bc.ios, nios);
+    pthread_mutex_lock(&bc.lock);
+    // 写回期间这些项不会被修改，写回成功后就是干净的；失败时仍然是脏的，下次再写回
+    for (uint32_t k = 0; k < n; k++) {
+        bc.entries[bc.order[k]].writing = false;
+        if (err == 0) {
+            bc.entries[bc.order[k]].dirty = false;
+        }
+    }
+    bc.flushing = false;
+    pthread_cond_broadcast(&bc.io_cond);
+    if (err != 0) {
+        return -EIO;
+    }
+    bc.writebacks += n;
+    return 0;
+}
+
+// 取得 sec 对应的缓存项（不存在时淘汰 LRU 尾部最久未用、未被 pin 住且不在读写中的项），并移到 LRU 表头。
+// 没有可淘汰的项时 err 为 -EAGAIN，调用者应在 io_cond 上等待后重试；写回脏扇区失败时 err 为 -EIO。需持有锁。
+static BufferEntry* acquire(sector_t sec, bool* hit, int* err) {
+    uint32_t i;
+    for (;;) {
+        i = lookup(sec);
+        *hit = i != BCACHE_NONE;
+        if (*hit) {
+            break;
+        }
+        i = bc.lru_tail;
+        while (i != BCACHE_NONE && (bc.entries[i].pins > 0 || bc.entries[i].loading || bc.entries[i].writing)) {
+            i = bc.entries[i].prev;
+        }
+        if (i == BCACHE_NONE) {
+            *err = -EAGAIN;
+            return NULL;
+        }
+        BufferEntry* victim = &bc.entries[i];
+        if (!victim->valid || !victim->dirty) {
+            if (victim->hashed) {
+                hash_remove(i);
+            }
+            victim->sector = sec;
+            victim->valid = false;
+            victim->hashed = true;
+            victim->hash_next = bc.buckets[bucket_of(sec)];
+            bc.buckets[bucket_of(sec)] = i;
+            break;
+        }
+        // 要淘汰脏扇区时，按扇区号顺序一次写回所有脏扇区，避免每次淘汰都把磁头拉到别处。
+        // 写回时释放了锁，其它线程可能已经读入了 sec 或用掉了这一项，重新查找
+        if (flush_locked() != 0) {
+            *err = -EIO;
+            return NULL;
+        }
+    }
+    lru_unlink(i);
+    lru_push_front(i);
+    return &bc.entries[i];
+}
+
+static void* flusher_main(void* arg) {
+    pthread_mutex_lock(&bc.lock);
+    while (bc.running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += BCACHE_FLUSH_SEC;
+        pthread_cond_timedwait(&bc.stop_cond, &bc.lock, &deadline);
+        if (bc.running) {
+            flush_locked();
+        }
+    }
+    pthread_mutex_unlock(&bc.lock);
+    return NULL;
+}
+
+// 读入 [start, start + count)。buffer 为 NULL 时只把数据读入缓存（预读）。
+static int read_range(sector_t start, size_t count, void* buffer) {
+    BufferEntry* run[BCACHE_RUN];
+    bool own[BCACHE_RUN];
+    struct iovec iov[BCACHE_RUN];
+    DiskIO ios[BCACHE_RUN];
+    int ret = 0;
+    pthread_mutex_lock(&bc.lock);
+    for (size_t done = 0; done < count && ret == 0;) {
+        size_t n = min(count - done, BCACHE_RUN);
+        size_t pinned = 0;
+        while (pinned < n) {
+            bool hit;
+            int err;
+            BufferEntry* e = acquire(start + done + pinned, &hit, &err);
+            if (e == NULL && err == -EAGAIN && pinned == 0) {
+                // 所有项都被 pin 住或正在读写：等其它线程用完后重试，这不是读错误
+                pthread_cond_wait(&bc.io_cond, &bc.lock);
+                continue;
+            }
+            if (e == NULL) {
+                // 先处理已经 pin 住的扇区，剩下的下一轮再读；等待时不持有 pin，避免线程之间互相等待
+                if (err != -EAGAIN) {
+                    ret = 1;
+                }
+                break;
+            }
+            hit = e->valid || e->loading;
+            if (buffer != NULL) {
+                if (hit) bc.hits++; else bc.misses++;
+            } else if (!hit) {
+                bc.prefetched++;
+            }
+            // 缓存中没有、也没有其它线程在读的扇区由本线程读入
+            own[pinned] = !hit;
+            e->loading |= own[pinned];
+            e->pins++;
+            run[pinned++] = e;
+        }
+        // 本线程负责的扇区按连续段组成一批请求读入，读盘时释放锁
+        int nios = 0;
+        for (size_t i = 0; i < pinned;) {
+            size_t cnt = 0;
+            while (i + cnt < pinned && own[i + cnt]) {
+                iov[i + cnt].iov_base = run[i + cnt]->data;
+                iov[i + cnt].iov_len = PHYSICAL_SECTOR_SIZE;
+                cnt++;
+            }
+            if (cnt == 0) {
+                i++;
+                continue;
+            }
+            ios[nios++] = (DiskIO){ .start = start + done + i, .iov = &iov[i], .iovcnt = cnt, .write = false };
+            i += cnt;
+        }
+        if (nios > 0) {
+            pthread_mutex_unlock(&bc.lock);
+            int err = sectors_submit(ios, nios);
+            pthread_mutex_lock(&bc.lock);
+            for (size_t i = 0; i < pinned; i++) {
+                if (own[i]) {
+                    run[i]->loading = false;
+                    run[i]->valid = err == 0;
+                    run[i]->dirty = false;
+                }
+            }
+            pthread_cond_broadcast(&bc.io_cond);
+        }
+        // 自己的读入完成后再等待其它线程正在读入的扇区，避免互相等待
+        for (size_t i = 0; i < pinned; i++) {
+            while (run[i]->loading) {
+                pthread_cond_wait(&bc.io_cond, &bc.lock);
+            }
+            if (!run[i]->valid) {
+                ret = 1;
+            }
+        }
+        bool unpinned = false;
+        for (size_t i = 0; i < pinned; i++) {
+            if (ret == 0 && buffer != NULL) {
+                memcpy((char*)buffer + (done + i) * PHYSICAL_SECTOR_SIZE, run[i]->data, PHYSICAL_SECTOR_SIZE);
+            }
+            unpinned |= --run[i]->pins == 0;
+        }
+        if (unpinned) {
+            pthread_cond_broadcast(&bc.io_cond);  // 唤醒等待可淘汰项的线程
+        }
+        done += pinned;
+    }
+    pthread_mutex_unlock(&bc.lock);
+    return ret;
+}
+
+static void* prefetcher_main(void* arg) {
+    pthread_mutex_lock(&bc.lock);
+    while (bc.prefetching) {
+        if (bc.ra_len == 0) {
+            pthread_cond_wait(&bc.ra_cond, &bc.lock);
+            continue;
+        }
+        PrefetchRequest req = bc.ra_queue[bc.ra_head];
+        bc.ra_head = (bc.ra_head + 1) % BCACHE_RA_QUEUE;
+        bc.ra_len--;
+        // 请求的第一个扇区已在缓存中，说明读者已经追上了这次预读，剩下的部分由读者自己读入
+        uint32_t i = lookup(req.start);
+        if (i != BCACHE_NONE && (bc.entries[i].valid || bc.entries[i].loading)) {
+            continue;
+        }
+        pthread_mutex_unlock(&bc.lock);
+        read_range(req.start, req.count, NULL);
+        pthread_mutex_lock(&bc.lock);
+    }
+    pthread_mutex_unlock(&bc.lock);
+    return NULL;
+}
+
+// 写入前等待该项的读入和写回完成，否则读入的旧数据会覆盖新写入的数据，或者写回的扇区被撕裂。需持有锁。
+static void wait_io(BufferEntry* e) {
+    e->pins++;
+    while (e->loading || e->writing) {
+        pthread_cond_wait(&bc.io_cond, &bc.lock);
+    }
+    if (--e->pins == 0) {
+        pthread_cond_broadcast(&bc.io_cond);
+    }
+}
+
+/**
+ * @brief 初始化缓冲区缓存，并启动定时刷新线程和预读线程
+ *
+ * @return int 成功返回 0
+ */
+int bcache_init(void) {
+    bc.nbuckets = 1;
+    while (bc.nbuckets < BCACHE_SECTORS) {
+        bc.nbuckets <<= 1;
+    }
+    bc.entries = calloc(BCACHE_SECTORS, sizeof(BufferEntry));
+    bc.buckets = malloc(bc.nbuckets * sizeof(uint32_t));
+    bc.order = malloc(BCACHE_SECTORS * sizeof(uint32_t));
+    bc.iov = malloc(BCACHE_SECTORS * sizeof(struct iovec));
+    bc.ios = malloc(BCACHE_SECTORS * sizeof(DiskIO));
+    if (bc.entries == NULL || bc.buckets == NULL || bc.order == NULL || bc.iov == NULL || bc.ios == NULL) {
+        return -ENOMEM;
+    }
+    memset(bc.buckets, 0xff, bc.nbuckets * sizeof(uint32_t));
+    bc.lru_head = bc.lru_tail = BCACHE_NONE;
+    for (uint32_t i = 0; i < BCACHE_SECTORS; i++) {
+        lru_push_front(i);
+    }
+    bc.hits = bc.misses = bc.writebacks = bc.prefetched = 0;
+    bc.ra_head = bc.ra_len = 0;
+    bc.flushing = false;
+    bc.running = true;
+    if (pthread_create(&bc.flusher, NULL, flusher_main, NULL) != 0) {
+        bc.running = false;
+    }
+    bc.prefetching = true;
+    if (pthread_create(&bc.prefetcher, NULL, prefetcher_main, NULL) != 0) {
+        bc.prefetching = false;
+    }
+    return 0;
+}
+
+/**
+ * @brief 读取一个扇区，优先从缓存中读取
+ */
+int bcache_read(sector_t sec_num, void* buffer) {
+    return read_range(sec_num, 1, buffer);
+}
+
+/**
+ * @brief 写入一个扇区：只写入缓存并标记为脏，之后再写回磁盘
+ */
+int bcache_write(sector_t sec_num, const void* buffer) {
+    return bcache_write_sectors(sec_num, 1, buffer);
+}
+
+/**
+ * @brief 读取从 start 开始的 count 个连续扇区，缓存中没有的扇区按连续段一次读入；buffer 为 NULL 时只读入缓存
+ */
+int bcache_read_sectors(sector_t start, size_t count, void* buffer) {
+    return read_range(start, count, buffer);
+}
+
+/**
+ * @brief 异步预读从 start 开始的 count 个连续扇区到缓存中，不等待读入完成
+ */
+void bcache_prefetch(sector_t start, size_t count) {
+    pthread_mutex_lock(&bc.lock);
+    if (bc.prefetching && bc.ra_len < BCACHE_RA_QUEUE) {
+        bc.ra_queue[(bc.ra_head + bc.ra_len) % BCACHE_RA_QUEUE] = (PrefetchRequest){start, count};
+        bc.ra_len++;
+        pthread_cond_signal(&bc.ra_cond);
+    }
+    pthread_mutex_unlock(&bc.lock);
+}
+
+/**
+ * @brief 写入从 start 开始的 count 个连续扇区，只写入缓存
+ */
+int bcache_write_sectors(sector_t start, size_t count, const void* buffer) {
+    pthread_mutex_lock(&bc.lock);
+    for (size_t i = 0; i < count; i++) {
+        bool hit;
+        int err;
+        BufferEntry* e;
+        while ((e = acquire(start + i, &hit, &err)) == NULL && err == -EAGAIN) {
+            pthread_cond_wait(&bc.io_cond, &bc.lock);  // 所有项都被 pin 住或正在读写，等待后重试
+        }
+        if (e == NULL) {
+            pthread_mutex_unlock(&bc.lock);
+            return 1;
+        }
+        if (hit) bc.hits++; else bc.misses++;
+        wait_io(e);
+        memcpy(e->data, (const char*)buffer + i * PHYSICAL_SECTOR_SIZE, PHYSICAL_SECTOR_SIZE);
+        e->valid = true;
+        e->dirty = true;
+    }
+    pthread_mutex_unlock(&bc.lock);
+    return 0;
+}
+
+/**
+ * @brief 将所有脏扇区写回磁盘
+ *
+ * @return int 成功返回 0
+ */
+int bcache_flush(void) {
+    pthread_mutex_lock(&bc.lock);
+    int ret = flush_locked();
+    pthread_mutex_unlock(&bc.lock);
+    return ret;
+}
+
+/**
+ * @brief 停止刷新线程和预读线程，写回所有脏扇区并释放缓存
+ */
+void bcache_destroy(void) {
+    pthread_mutex_lock(&bc.lock);
+    bool running = bc.running, prefetching = bc.prefetching;
+    bc.running = false;
+    bc.prefetching = false;
+    pthread_cond_signal(&bc.stop_cond);
+    pthread_cond_signal(&bc.ra_cond);
+    pthread_mutex_unlock(&bc.lock);
+    if (running) {
+        pthread_join(bc.flusher, NULL);
+    }
+    if (prefetching) {
+        pthread_join(bc.prefetcher, NULL);
+    }
+    bcache_flush();
+    printf("bcache: %lu hits, %lu misses, %lu prefetched, %lu write-backs\n",
+           bc.hits, bc.misses, bc.prefetched, bc.writebacks);
+    free(bc.entries);
+    free(bc.buckets);
+    free(bc.order);
+    free(bc.iov);
+    free(bc.ios);
+    bc.entries = NULL;
+    bc.buckets = NULL;
+    bc.order = NULL;
+    bc.iov = NULL;
+    bc.ios = NULL;
+}
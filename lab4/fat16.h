@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #define FUSE_USE_VERSION 31
 #include <fuse.h>
@@ -117,5 +118,33 @@ enum FindResult {
 
 int sector_read(sector_t sec_num, void *buffer);
 int sector_write(sector_t sec_num, const void *buffer);
+/* 读写从 start 开始的 count 个连续扇区，整段只寻道一次；v 版本把数据分散到/收集自多个缓冲区 */
+int sectors_read(sector_t start, size_t count, void *buffer);
+int sectors_write(sector_t start, size_t count, const void *buffer);
+int sectors_readv(sector_t start, const struct iovec *iov, int iovcnt);
+int sectors_writev(sector_t start, const struct iovec *iov, int iovcnt);
+
+/* 一个磁盘请求。sectors_submit 一次提交一批请求，由磁盘调度器（--sched=fcfs|scan|clook|deadline）
+ * 排序后执行，全部完成后返回 */
+typedef struct {
+    sector_t start;
+    const struct iovec *iov;
+    int iovcnt;
+    bool write;
+} DiskIO;
+int sectors_submit(const DiskIO *ios, int n);
+
+/* 扇区缓冲区缓存（buffer_cache.c），文件系统的所有扇区读写都经过它 */
+#define BCACHE_SECTORS   4096   // 缓存的扇区数（2 MiB）
+#define BCACHE_FLUSH_SEC 5      // 脏扇区定时写回的间隔（秒）
+
+int bcache_init(void);
+int bcache_read(sector_t sec_num, void *buffer);
+int bcache_write(sector_t sec_num, const void *buffer);
+int bcache_read_sectors(sector_t start, size_t count, void *buffer);   // buffer 为 NULL 时只读入缓存
+int bcache_write_sectors(sector_t start, size_t count, const void *buffer);
+void bcache_prefetch(sector_t start, size_t count);
+int bcache_flush(void);
+void bcache_destroy(void);
 
 #endif
\ No newline at end of file
@@ -2,18 +2,72 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include "fat16.h"
 
 static int fd;
 
+/*
+ * 磁盘请求调度：sectors_submit 把一批请求放入队列，磁盘空闲时按调度策略选出下一个请求执行。
+ * 多个线程（FUSE 线程、预读线程、写回）同时提交的请求在队列中一起排序，减少磁头移动。
+ *   fcfs      按到达顺序
+ *   scan      电梯算法，沿当前方向处理最近的请求，该方向没有请求时掉头
+ *   clook     只向磁道号增大的方向处理，到头后跳回最小的请求
+ *   deadline  按 clook 处理，但最早到达的请求超时（读 READ_EXPIRE_US，写 WRITE_EXPIRE_US）时优先处理，
+ *             之后从它的位置继续按 clook 处理 DEADLINE_BATCH 个请求，避免大量请求超时时退化为 fcfs
+ */
+enum SchedPolicy {
+    SCHED_FCFS,
+    SCHED_SCAN,
+    SCHED_CLOOK,
+    SCHED_DEADLINE,
+    SCHED_COUNT
+};
+static const char* sched_names[SCHED_COUNT] = {"fcfs", "scan", "clook", "deadline"};
+
+#define READ_EXPIRE_US  500000      // 读请求的最长等待时间
+#define WRITE_EXPIRE_US 5000000     // 写请求的最长等待时间
+#define DEADLINE_BATCH  16          // 处理一个超时请求后，至少按 clook 顺序处理的请求数
+
+typedef struct DiskRequest {
+    const DiskIO* io;
+    size_t bytes;
+    uint64_t deadline_us;
+    int* pending;               // 所在批次还未完成的请求数
+    int* error;                 // 所在批次是否有请求失败
+    struct DiskRequest* next;   // 按到达顺序的等待队列
+} DiskRequest;
+
+struct sched_stat {
+    uint64_t requests;          // 按该策略选出的请求数
+    uint64_t seeks;
+    uint64_t seek_tracks;
+};
+
 struct disk_info {
     uint64_t seek_time_us;      // 磁头移动一个磁道所需时间
     long last_track;
     long total_track;
+    uint64_t seeks;             // 磁头移动的次数
+    uint64_t seek_tracks;       // 磁头移动的总磁道数
+    enum SchedPolicy policy;
+    bool up;                    // scan 的当前方向
+    int batch;                  // deadline 在处理超时请求后还要按 clook 处理的请求数
+    DiskRequest* head;          // 等待队列
+    DiskRequest** tail;
+    bool busy;                  // 有线程正在执行请求
+    struct sched_stat stat[SCHED_COUNT];
 };
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;    // 有请求完成，磁盘空闲
 static struct disk_info di;
 
+static uint64_t now_us(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
 void busywait(long us) {
     struct timespec s, t;
     clock_gettime(CLOCK_MONOTONIC, &s);
@@ -30,44 +84,181 @@ void busywait(long us) {
     }
 }
 
-void seek_to(sector_t sec) {
+// 磁头移到 sec 所在的磁道，返回移动的磁道数
+long seek_to(sector_t sec) {
     long track = sec / SEC_PER_TRACK;
     long delta = labs(track - di.last_track);
+    if (delta != 0) {
+        di.seeks++;
+        di.seek_tracks += delta;
+    }
     busywait(delta * di.seek_time_us);
     di.last_track = track;
+    return delta;
 }
 
-int sector_read(sector_t sec_num, void *buffer) {
-    if(pthread_mutex_lock(&mutex) != 0) {
-        printf("read sector %lu error: lock failed.\n", sec_num);
-        return 1;
+static size_t iov_bytes(const struct iovec *iov, int iovcnt) {
+    size_t bytes = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
     }
-    seek_to(sec_num);
-    ssize_t ret = pread(fd, buffer, PHYSICAL_SECTOR_SIZE, sec_num * PHYSICAL_SECTOR_SIZE);
-    pthread_mutex_unlock(&mutex);
-    if(ret != PHYSICAL_SECTOR_SIZE) {
-        printf("read sector %lu error: image read failed.\n", sec_num);
-        return 1;
+    return bytes;
+}
+
+// 磁头移到 start 之后连续传输整段数据，结束时停在这段的最后一个扇区所在的磁道
+static long seek_run(sector_t start, size_t bytes) {
+    long delta = seek_to(start);
+    di.last_track = (start + bytes / PHYSICAL_SECTOR_SIZE - 1) / SEC_PER_TRACK;
+    return delta;
+}
+
+static long track_of(const DiskRequest* r) {
+    return r->io->start / SEC_PER_TRACK;
+}
+
+// 在 [from, to) 的磁道范围内找离磁头最近的请求；up 为 true 时找磁道号最小的，否则找最大的
+static DiskRequest** nearest(long from, long to, bool up) {
+    DiskRequest** best = NULL;
+    for (DiskRequest** p = &di.head; *p != NULL; p = &(*p)->next) {
+        long t = track_of(*p);
+        if (t < from || t >= to) {
+            continue;
+        }
+        // 同一磁道上按扇区号顺序，否则按距离
+        if (best == NULL || (up ? (*p)->io->start < (*best)->io->start : (*p)->io->start > (*best)->io->start)) {
+            best = p;
+        }
     }
-    return 0;
+    return best;
 }
 
-int sector_write(sector_t sec_num, const void *buffer) {
-    if(pthread_mutex_lock(&mutex) != 0) {
-        printf("write sector %lu error: lock failed.\n", sec_num);
-        return 1;
+// 按调度策略从队列中选出下一个请求，*used 返回实际使用的策略。需持有 mutex，队列非空。
+static DiskRequest** pick(enum SchedPolicy* used) {
+    long head = di.last_track;
+    *used = di.policy;
+    switch (di.policy) {
+    case SCHED_FCFS:
+        return &di.head;
+    case SCHED_SCAN: {
+        DiskRequest** p = di.up ? nearest(head, LONG_MAX, true) : nearest(LONG_MIN, head + 1, false);
+        if (p == NULL) {
+            di.up = !di.up;
+            p = di.up ? nearest(head, LONG_MAX, true) : nearest(LONG_MIN, head + 1, false);
+        }
+        return p;
+    }
+    case SCHED_DEADLINE:
+        if (di.batch == 0 && di.head->deadline_us <= now_us()) {
+            di.batch = DEADLINE_BATCH;
+            return &di.head;
+        }
+        if (di.batch > 0) {
+            di.batch--;
+        }
+        *used = SCHED_CLOOK;
+        // fall through
+    default: {
+        DiskRequest** p = nearest(head, LONG_MAX, true);
+        return p != NULL ? p : nearest(LONG_MIN, LONG_MAX, true);
+    }
+    }
+}
+
+// 从队列中选出一个请求执行，执行时不持有锁，其它线程可以继续提交请求。需持有 mutex，队列非空。
+static void dispatch_one(void) {
+    enum SchedPolicy used;
+    DiskRequest** p = pick(&used);
+    DiskRequest* r = *p;
+    *p = r->next;
+    if (*p == NULL) {
+        di.tail = p;
     }
-    seek_to(sec_num);
-    ssize_t ret = pwrite(fd, buffer, PHYSICAL_SECTOR_SIZE, sec_num * PHYSICAL_SECTOR_SIZE);
+    di.busy = true;
     pthread_mutex_unlock(&mutex);
-    if(ret != PHYSICAL_SECTOR_SIZE) {
-        printf("write sector %lu error: image write failed.\n", sec_num);
+    uint64_t seeks = di.seeks;
+    long delta = seek_run(r->io->start, r->bytes);
+    off_t off = r->io->start * PHYSICAL_SECTOR_SIZE;
+    ssize_t ret = r->io->write ? pwritev(fd, r->io->iov, r->io->iovcnt, off) : preadv(fd, r->io->iov, r->io->iovcnt, off);
+    pthread_mutex_lock(&mutex);
+    di.busy = false;
+    di.stat[used].requests++;
+    di.stat[used].seeks += di.seeks - seeks;
+    di.stat[used].seek_tracks += delta;
+    if (ret != (ssize_t)r->bytes) {
+        printf("%s sector %lu error: image %s failed.\n", r->io->write ? "write" : "read", r->io->start,
+               r->io->write ? "write" : "read");
+        *r->error = 1;
+    }
+    (*r->pending)--;
+    pthread_cond_broadcast(&done_cond);
+}
+
+/**
+ * @brief 提交一批磁盘请求，按调度策略排序执行，全部完成后返回。
+ *        磁盘空闲时由提交请求的线程自己选出并执行队列中的请求（可能是其它线程的），
+ *        磁盘忙时等待，不需要单独的调度线程，只有一个线程访问磁盘时也没有线程切换的开销。
+ *
+ * @return int 成功返回 0，有请求失败时返回 1
+ */
+int sectors_submit(const DiskIO *ios, int n) {
+    DiskRequest reqs[n];
+    int pending = n, error = 0;
+    uint64_t now = now_us();
+    if (pthread_mutex_lock(&mutex) != 0) {
+        printf("%s sector %lu error: lock failed.\n", ios[0].write ? "write" : "read", ios[0].start);
         return 1;
     }
-    return 0;
+    for (int i = 0; i < n; i++) {
+        reqs[i] = (DiskRequest){
+            .io = &ios[i],
+            .bytes = iov_bytes(ios[i].iov, ios[i].iovcnt),
+            .deadline_us = now + (ios[i].write ? WRITE_EXPIRE_US : READ_EXPIRE_US),
+            .pending = &pending,
+            .error = &error,
+        };
+        *di.tail = &reqs[i];
+        di.tail = &reqs[i].next;
+    }
+    while (pending > 0) {
+        if (di.busy) {
+            pthread_cond_wait(&done_cond, &mutex);
+        } else {
+            dispatch_one();
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return error;
+}
+
+int sectors_readv(sector_t start, const struct iovec *iov, int iovcnt) {
+    DiskIO io = { .start = start, .iov = iov, .iovcnt = iovcnt, .write = false };
+    return sectors_submit(&io, 1);
+}
+
+int sectors_writev(sector_t start, const struct iovec *iov, int iovcnt) {
+    DiskIO io = { .start = start, .iov = iov, .iovcnt = iovcnt, .write = true };
+    return sectors_submit(&io, 1);
+}
+
+int sectors_read(sector_t start, size_t count, void *buffer) {
+    struct iovec iov = { .iov_base = buffer, .iov_len = count * PHYSICAL_SECTOR_SIZE };
+    return sectors_readv(start, &iov, 1);
+}
+
+int sectors_write(sector_t start, size_t count, const void *buffer) {
+    struct iovec iov = { .iov_base = (void *)buffer, .iov_len = count * PHYSICAL_SECTOR_SIZE };
+    return sectors_writev(start, &iov, 1);
+}
+
+int sector_read(sector_t sec_num, void *buffer) {
+    return sectors_read(sec_num, 1, buffer);
 }
 
-void init_disk(const char* path, uint64_t seek_time_ns) {
+int sector_write(sector_t sec_num, const void *buffer) {
+    return sectors_write(sec_num, 1, buffer);
+}
+
+void init_disk(const char* path, uint64_t seek_time_ns, const char* sched) {
     fd = open(path, O_RDWR | O_DSYNC);
     if(fd < 0) {
         fprintf(stderr, "Open image file %s failed: %s\n", path, strerror(errno));
@@ -76,17 +267,46 @@ void init_disk(const char* path, uint64_t seek_time_ns) {
     di.seek_time_us = seek_time_ns;
     di.last_track = 0;
     di.total_track = lseek(fd, 0, SEEK_END) / PHYSICAL_SECTOR_SIZE / SEC_PER_TRACK;
+    di.policy = SCHED_COUNT;
+    for (int i = 0; i < SCHED_COUNT; i++) {
+        if (strcmp(sched, sched_names[i]) == 0) {
+            di.policy = i;
+        }
+    }
+    if (di.policy == SCHED_COUNT) {
+        fprintf(stderr, "Unknown scheduler %s\n", sched);
+        exit(EINVAL);
+    }
+    di.up = true;
+    di.batch = 0;
+    di.head = NULL;
+    di.tail = &di.head;
+    di.busy = false;
+}
+
+// 输出各调度策略的寻道统计
+void close_disk(void) {
+    printf("disk: %lu seeks, %lu tracks (%s)\n", di.seeks, di.seek_tracks, sched_names[di.policy]);
+    for (int i = 0; i < SCHED_COUNT; i++) {
+        if (di.stat[i].requests > 0) {
+            printf("  %-8s %lu requests, %lu seeks, %lu tracks\n", sched_names[i],
+                   di.stat[i].requests, di.stat[i].seeks, di.stat[i].seek_tracks);
+        }
+    }
+    close(fd);
 }
 
 typedef struct {
     const char* image_path;
     uint64_t seek_time_us;
+    const char* sched;
 } Options;
 
 #define OPTION(t, p) { t, offsetof(Options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--img=%s", image_path),
     OPTION("--seek_time=%lu", seek_time_us),
+    OPTION("--sched=%s", sched),
     FUSE_OPT_END
 };
 
@@ -98,12 +318,14 @@ int main(int argc, char *argv[])
     Options opts;
     opts.image_path = strdup(DEFAULT_IMAGE);
     opts.seek_time_us = 0;
+    opts.sched = strdup("deadline");
     int ret = fuse_opt_parse(&args, &opts, option_spec, NULL);
     if(ret < 0) {
         return EXIT_FAILURE;
     }
-    init_disk(opts.image_path, opts.seek_time_us);
+    init_disk(opts.image_path, opts.seek_time_us, opts.sched);
     ret = fuse_main(args.argc, args.argv, &fat16_oper, NULL);
+    close_disk();
     fuse_opt_free_args(&args);
     return ret;
-}
\ No newline at end of file
+}
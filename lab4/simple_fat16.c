@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/timeb.h>
@@ -38,6 +39,39 @@ typedef struct {
 
 FAT16 meta;
 
+/* FAT 表缓存：挂载时把第一个 FAT 表整个读入内存（FAT16 最多 128 KiB），查表不再访问磁盘。
+   write_fat_entry 只修改内存并标记扇区为脏，释放 fat_lock 写锁时 fat_write_unlock() 调用 fat_flush()
+   把脏扇区写入缓冲区缓存中的每一个 FAT 表。修改 FAT 之后才写目录项，所以缓冲区缓存里的目录项引用的簇，
+   其 FAT 表项一定已经在缓冲区缓存中，缓冲区缓存任何时候写回磁盘，都不会出现目录项指向空闲簇的情况。 */
+static cluster_t* fat_table;  // FAT 表内容，按簇号索引
+static uint8_t* fat_dirty;    // 每个 FAT 扇区一个标记，1 表示尚未写回
+
+/* 空闲簇位图：第 clus 位为 1 表示该簇空闲，由 write_fat_entry 维护。
+   分配时从 free_hint 开始按 64 位字扫描，找不到时回绕到开头。 */
+static uint64_t* free_map;
+static uint64_t* resv_map;     // 被预分配窗口预留的簇，这些簇在 FAT 表中仍是空闲的
+static cluster_t fat_entries;  // 有效簇号上界（不含），即 min(数据簇数 + 2, FAT 表项数)
+static cluster_t free_hint;    // 下次分配开始查找的簇号
+static uint32_t free_count;    // 空闲簇个数
+
+/* 预分配窗口：为正在增长的文件在它末尾之后预留一段连续的簇，交错追加的多个文件不会互相穿插。
+   窗口只存在于内存中，用下一个要分配的簇号 next 识别：最后一个簇为 next - 1 的文件拥有该窗口。 */
+#define ALLOC_WINDOW   16      // 每个窗口预留的簇数
+#define ALLOC_WINDOWS  64      // 窗口个数，用完时淘汰最久未使用的窗口
+
+typedef struct {
+    cluster_t next, end;       // 预留的簇为 [next, end)，next == end 表示窗口未使用
+    uint64_t stamp;            // 最近一次使用的时间
+} AllocWindow;
+
+static AllocWindow windows[ALLOC_WINDOWS];
+static uint64_t window_clock;
+
+/* 多线程：FUSE 默认用多个线程同时调用文件系统的操作，各部分数据由不同的锁保护。需要同时持有多个锁时按以下顺序加锁：
+   目录锁 dir_locks -> 打开文件表锁 handles_lock -> 文件锁 FileHandle.lock -> FAT 表锁 fat_lock
+   -> 目录项扇区锁 entry_locks -> 目录项缓存锁 dcache.lock。缓冲区缓存和磁盘有自己的锁，持有以上任何锁时都可以调用。 */
+static pthread_rwlock_t fat_lock = PTHREAD_RWLOCK_INITIALIZER;  // 保护 FAT 表缓存、空闲簇位图和预分配窗口
+
 #define ATTR_CONTAINS(attr, attr_name) ((attr & attr_name) != 0)
 
 size_t sector_offset(sector_t sector) {
@@ -186,13 +220,6 @@ int to_longname(const uint8_t fat_name[11], char* res, size_t len) {
     return i;
 }
 
-// 比较长文件名是否和 dir 目录项中的文件匹配
-bool check_name(const char* name, size_t len, const DIR_ENTRY* dir) {
-    char fatname[11];
-    to_shortname(name, len, fatname);
-    return strncmp(fatname, (const char*)dir->DIR_Name, FAT_NAME_LEN) == 0;
-}
-
 /**
  * @brief 读取簇号为 clus 对应的 FAT 表项
  *
@@ -205,14 +232,127 @@ cluster_t read_fat_entry(cluster_t clus) {
     // 2. 使用 sector_read 函数读取该扇区
     // 3. 计算簇号 clus 对应的 FAT 表项在该扇区中的偏移量
     // 4. 从该偏移量处读取对应表项的值，并返回
-    char sector_buffer[PHYSICAL_SECTOR_SIZE];
-    size_t clus_off = clus * sizeof(cluster_t);
-    sector_t clus_sec = clus_off / meta.sector_size;
-    sector_read(clus_sec + meta.reserved, sector_buffer);
-    size_t sec_off = clus_off % meta.sector_size;
-    cluster_t res = 0;
-    memcpy(&res, sector_buffer + sec_off, sizeof(res) / sizeof(char));
-    return res;
+    // 现在直接查内存中的 FAT 表缓存，调用者需持有 fat_lock
+    return fat_table[clus];
+}
+
+// 不持有 fat_lock 时遍历簇链（例如查找目录）使用，只在读取这一项时加读锁
+static cluster_t fat_next(cluster_t clus) {
+    pthread_rwlock_rdlock(&fat_lock);
+    cluster_t next = read_fat_entry(clus);
+    pthread_rwlock_unlock(&fat_lock);
+    return next;
+}
+
+static bool bit_test(const uint64_t* map, cluster_t clus) {
+    return (map[clus / 64] >> (clus % 64)) & 1;
+}
+
+static void bit_assign(uint64_t* map, cluster_t clus, bool value) {
+    if (value) {
+        map[clus / 64] |= 1ull << (clus % 64);
+    } else {
+        map[clus / 64] &= ~(1ull << (clus % 64));
+    }
+}
+
+static void free_map_set(cluster_t clus, bool free) {
+    bit_assign(free_map, clus, free);
+    if (free) {
+        free_count++;
+    } else {
+        free_count--;
+    }
+}
+
+/**
+ * @brief 查找 [from, fat_entries) 中第一个可分配（空闲且未被预留）的簇，want 为 false 时查找第一个不可分配的簇
+ *
+ * @return cluster_t 找到的簇号，没有则返回 fat_entries
+ */
+static cluster_t avail_scan(cluster_t from, bool want) {
+    size_t words = (fat_entries + 63) / 64;
+    size_t w = from / 64;
+    if (from >= fat_entries) {
+        return fat_entries;
+    }
+    uint64_t flip = want ? 0 : ~0ull;
+    uint64_t bits = ((free_map[w] & ~resv_map[w]) ^ flip) & (~0ull << (from % 64));
+    while (bits == 0) {
+        if (++w >= words) {
+            return fat_entries;
+        }
+        bits = (free_map[w] & ~resv_map[w]) ^ flip;
+    }
+    return min(w * 64 + __builtin_ctzll(bits), fat_entries);
+}
+
+/**
+ * @brief 将第一个 FAT 表读入 fat_table，并据此建立空闲簇位图
+ *
+ * @return int 成功返回 0
+ */
+int fat_load(void) {
+    size_t bytes = (size_t)meta.sec_per_fat * meta.sector_size;
+    fat_table = malloc(bytes);
+    fat_dirty = calloc(meta.sec_per_fat, 1);
+    if (fat_table == NULL || fat_dirty == NULL) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < meta.sec_per_fat; i++) {
+        if (bcache_read(meta.fat_sec + i, (char*)fat_table + i * meta.sector_size) != 0) {
+            return -EIO;
+        }
+    }
+
+    size_t entries = bytes / sizeof(cluster_t);
+    if (entries > (size_t)meta.clusters + CLUSTER_MIN) {
+        entries = (size_t)meta.clusters + CLUSTER_MIN;
+    }
+    if (entries > (size_t)CLUSTER_MAX + 1) {
+        entries = (size_t)CLUSTER_MAX + 1;
+    }
+    fat_entries = entries;
+    free_map = calloc((entries + 63) / 64, sizeof(uint64_t));
+    resv_map = calloc((entries + 63) / 64, sizeof(uint64_t));
+    if (free_map == NULL || resv_map == NULL) {
+        return -ENOMEM;
+    }
+    free_count = 0;
+    for (cluster_t clus = CLUSTER_MIN; clus < fat_entries; clus++) {
+        if (fat_table[clus] == CLUSTER_FREE) {
+            free_map_set(clus, true);
+        }
+    }
+    free_hint = CLUSTER_MIN;
+    return 0;
+}
+
+/**
+ * @brief 把 FAT 表缓存中的脏扇区写回到所有 FAT 表
+ *
+ * @return int 成功返回 0
+ */
+int fat_flush(void) {
+    for (size_t i = 0; i < meta.sec_per_fat; i++) {
+        if (!fat_dirty[i]) {
+            continue;
+        }
+        for (size_t f = 0; f < meta.fats; f++) {
+            sector_t sector = meta.fat_sec + f * meta.sec_per_fat + i;
+            if (bcache_write(sector, (char*)fat_table + i * meta.sector_size) != 0) {
+                return -EIO;
+            }
+        }
+        fat_dirty[i] = 0;
+    }
+    return 0;
+}
+
+// 释放 fat_lock 写锁，释放前把这次修改的 FAT 扇区写入缓冲区缓存，之后写的目录项才能引用这些簇
+static void fat_write_unlock(void) {
+    fat_flush();  // 失败时扇区仍标记为脏，下次释放写锁时重试
+    pthread_rwlock_unlock(&fat_lock);
 }
 
 /**
@@ -224,31 +364,182 @@ typedef struct {
     size_t offset;    // 目录项在扇区中的偏移量
 } DirEntrySlot;
 
+/* 目录项缓存：以（父目录首簇号，8+3 文件名）为键缓存路径查找的结果，根目录下的项父目录簇号记为 0。
+   找不到的名字也缓存为负项。目录项的修改都经过 dir_entry_write，由它更新或失效对应的缓存项。
+   哈希桶只按文件名划分，这样不知道父目录时也能按名字找到所有相关的项。 */
+#define DCACHE_ENTRIES 1024
+#define DCACHE_BUCKETS 256
+#define DCACHE_NONE    (-1)
+#define DCACHE_NEGATIVE 0
+#define DCACHE_POSITIVE 1
+
+typedef struct {
+    cluster_t parent;           // 父目录的首簇号
+    char name[FAT_NAME_LEN];    // 8+3 文件名
+    bool used;
+    bool positive;              // false 表示负项：父目录中没有这个名字
+    DirEntrySlot slot;          // 正项对应的目录项
+    int hash_next;
+} DEntry;
+
+static struct {
+    DEntry entries[DCACHE_ENTRIES];
+    int buckets[DCACHE_BUCKETS];
+    int victim;                 // 下一个被替换的项，按 FIFO 轮转
+    unsigned long gen;          // 每次 dcache_update 加一，查找期间目录被修改过时不缓存查找结果
+    unsigned long hits, misses;
+    pthread_mutex_t lock;
+} dcache;
+
+static unsigned dcache_hash(const char* name) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < FAT_NAME_LEN; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h % DCACHE_BUCKETS;
+}
+
+static void dcache_init(void) {
+    memset(&dcache, 0, sizeof(dcache));
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        dcache.buckets[i] = DCACHE_NONE;
+    }
+    pthread_mutex_init(&dcache.lock, NULL);
+}
+
+/**
+ * @brief 查找缓存的查找结果，命中正项时把目录项复制到 slot
+ *
+ * @param gen 返回当前的版本号，未命中时读完目录后把它传给 dcache_insert
+ * @return int DCACHE_POSITIVE、DCACHE_NEGATIVE，不在缓存中时返回 DCACHE_NONE
+ */
+static int dcache_get(cluster_t parent, const char* name, DirEntrySlot* slot, unsigned long* gen) {
+    int ret = DCACHE_NONE;
+    pthread_mutex_lock(&dcache.lock);
+    *gen = dcache.gen;
+    for (int i = dcache.buckets[dcache_hash(name)]; i != DCACHE_NONE; i = dcache.entries[i].hash_next) {
+        DEntry* d = &dcache.entries[i];
+        if (d->parent == parent && memcmp(d->name, name, FAT_NAME_LEN) == 0) {
+            if (d->positive) {
+                *slot = d->slot;
+            }
+            ret = d->positive ? DCACHE_POSITIVE : DCACHE_NEGATIVE;
+            break;
+        }
+    }
+    if (ret == DCACHE_NONE) dcache.misses++; else dcache.hits++;
+    pthread_mutex_unlock(&dcache.lock);
+    return ret;
+}
+
+static void dcache_remove(int i) {
+    DEntry* d = &dcache.entries[i];
+    int* p = &dcache.buckets[dcache_hash(d->name)];
+    while (*p != i) {
+        p = &dcache.entries[*p].hash_next;
+    }
+    *p = d->hash_next;
+    d->used = false;
+}
+
+// 缓存查找结果，slot 为 NULL 时插入负项。gen 为查找前 dcache_get 返回的版本号，之后目录被修改过时不插入
+static void dcache_insert(cluster_t parent, const char* name, const DirEntrySlot* slot, unsigned long gen) {
+    pthread_mutex_lock(&dcache.lock);
+    if (gen != dcache.gen) {
+        pthread_mutex_unlock(&dcache.lock);
+        return;
+    }
+    int i = dcache.victim;
+    dcache.victim = (dcache.victim + 1) % DCACHE_ENTRIES;
+    if (dcache.entries[i].used) {
+        dcache_remove(i);
+    }
+    DEntry* d = &dcache.entries[i];
+    d->parent = parent;
+    memcpy(d->name, name, FAT_NAME_LEN);
+    d->used = true;
+    d->positive = slot != NULL;
+    if (slot != NULL) {
+        d->slot = *slot;
+    }
+    unsigned b = dcache_hash(name);
+    d->hash_next = dcache.buckets[b];
+    dcache.buckets[b] = i;
+    pthread_mutex_unlock(&dcache.lock);
+}
+
 /**
- * @brief 在 from_sector 开始的连续 sectors_count 个扇区中查找 name 对应的目录项
+ * @brief 目录项 slot 即将被写入磁盘，原来位于该位置的目录项名为 old_name，更新目录项缓存：
+ *        同名同位置的正项更新为新内容；目录项被删除或改名时删除正项（删除的是目录时，同时删除以它为父目录的项）；
+ *        写入的是新目录项时，删除所有同名的负项。
+ */
+static void dcache_update(const uint8_t* old_name, const DirEntrySlot* slot) {
+    const DIR_ENTRY* dir = &slot->dir;
+    bool valid = !is_lfn(dir->DIR_Attr) && dir->DIR_Name[0] != NAME_DELETED && dir->DIR_Name[0] != NAME_FREE;
+    bool renamed = memcmp(old_name, dir->DIR_Name, FAT_NAME_LEN) != 0;
+    cluster_t removed_dir = CLUSTER_FREE;  // 被删除的目录的首簇号
+    pthread_mutex_lock(&dcache.lock);
+    dcache.gen++;
+    for (int i = dcache.buckets[dcache_hash((const char*)old_name)]; i != DCACHE_NONE;) {
+        DEntry* d = &dcache.entries[i];
+        int next = d->hash_next;
+        if (d->positive && d->slot.sector == slot->sector && d->slot.offset == slot->offset) {
+            if (valid && !renamed) {
+                d->slot.dir = *dir;
+            } else {
+                if (is_directory(d->slot.dir.DIR_Attr)) {
+                    removed_dir = d->slot.dir.DIR_FstClusLO;
+                }
+                dcache_remove(i);
+            }
+        }
+        i = next;
+    }
+    if (removed_dir != CLUSTER_FREE) {  // 目录的簇之后可能分配给新目录，删除它下面的所有项
+        for (int i = 0; i < DCACHE_ENTRIES; i++) {
+            if (dcache.entries[i].used && dcache.entries[i].parent == removed_dir) {
+                dcache_remove(i);
+            }
+        }
+    }
+    if (valid && renamed) {
+        for (int i = dcache.buckets[dcache_hash((const char*)dir->DIR_Name)]; i != DCACHE_NONE;) {
+            int next = dcache.entries[i].hash_next;
+            if (!dcache.entries[i].positive && memcmp(dcache.entries[i].name, dir->DIR_Name, FAT_NAME_LEN) == 0) {
+                dcache_remove(i);
+            }
+            i = next;
+        }
+    }
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+/**
+ * @brief 在 from_sector 开始的连续 sectors_count 个扇区中查找文件名为 shortname 的目录项
  *        找到对应目录项时返回 FIND_EXIST
  *        未找到对应目录项，但找到了空槽返回 FIND_EMPTY
  *        未找到对应目录项，且扇区都已满时返回 FIND_FULL
  *        出现其它错误，返回负数
- * @param name              要查找的文件名
- * @param len               文件名长度
+ * @param shortname         要查找的 8+3 文件名（to_shortname 的结果），为 NULL 时文件名不合法，只查找空槽
  * @param from_sector       要查找的第一个扇区号
  * @param sectors_count     要查找的扇区数
  * @param slot              找到的目录项，参考对 DirEntrySlot 的注释
  * @return long
  */
-int find_entry_in_sectors(const char* name, size_t len, sector_t from_sector, size_t sectors_count, DirEntrySlot* slot) {
+int find_entry_in_sectors(const char* shortname, sector_t from_sector, size_t sectors_count, DirEntrySlot* slot) {
     char buffer[PHYSICAL_SECTOR_SIZE];
     // 对每一个待查找的扇区：
     for (size_t i = 0; i < sectors_count; i++) {
         // DONE: 1.3 读取当前扇区，步骤如下：
         // 1. 使用 sector_read 函数读取从扇区号 from_sector 开始的第 i 个扇区
-        sector_read(from_sector + i, buffer);
+        if (bcache_read(from_sector + i, buffer) != 0) {
+            return -EIO;
+        }
         // 2. 对该扇区中的每一个目录项，检查是否是待查找的目录项（注意检查目录项是否合法）
         for (size_t offset = 0; offset < meta.sector_size; offset += DIR_ENTRY_SIZE) {
             DIR_ENTRY* dir = (DIR_ENTRY*)(buffer + offset);
             // 3. 如果是待查找的目录项，将该目录项的信息填入 slot 中，并返回 FIND_EXIST
-            if (check_name(name, len, dir)) {
+            if (shortname != NULL && memcmp(shortname, dir->DIR_Name, FAT_NAME_LEN) == 0) {
                 slot->dir = *dir;
                 slot->sector = from_sector + i;
                 slot->offset = offset;
@@ -273,12 +564,15 @@ int find_entry_in_sectors(const char* name, size_t len, sector_t from_sector, si
 /**
  * @brief 找到 path 所对应路径的目录项，如果最后一级路径不存在，则找到能创建最后一集文件 / 目录的空目录项。（这个函数同时实现了找目录项和找空槽的功能）
  *
+ *        每一级先查目录项缓存，缓存中没有时才读目录。
+ *
  * @param path          需要查找的路径
  * @param slot          最后一级找到的目录项，参考对 DirEntrySlot 的注释
  * @param remains       path 中未找到的部分
+ * @param need_empty    最后一级不存在时是否需要找到空目录项（为 false 时可以直接使用缓存的负项）
  * @return int 成功返回 0，失败返回错误代码的负值，可能的错误参见 brief 部分。
  */
-int find_entry_internal(const char* path, DirEntrySlot* slot, const char** remains) {
+int find_entry_internal(const char* path, DirEntrySlot* slot, const char** remains, bool need_empty) {
     *remains = path;
     *remains += strspn(*remains, "/");  // 跳过开头的'/'
 
@@ -289,35 +583,51 @@ int find_entry_internal(const char* path, DirEntrySlot* slot, const char** remai
     while (**remains != '\0' && state == FIND_EXIST) {
         size_t len = strcspn(*remains, "/");  // 目前要搜索的文件名长度
         // *remains 开始的，长为 len 的字符串是当前要搜索的文件名
+        // 下一级目录开始位置
+        const char* next_level = *remains + len;
+        next_level += strspn(next_level, "/");
 
-        if (level == 0) {
+        // 每一级只转换一次文件名，查缓存和比较目录项都用转换后的 8+3 文件名
+        char shortname[FAT_NAME_LEN];
+        bool cacheable = to_shortname(*remains, len, shortname) == 0;
+        const char* fatname = cacheable ? shortname : NULL;
+        cluster_t parent = level == 0 ? 0 : clus;
+        unsigned long gen = 0;
+        int cached = cacheable ? dcache_get(parent, shortname, slot, &gen) : DCACHE_NONE;
+        if (cached == DCACHE_POSITIVE) {
+            state = FIND_EXIST;
+        } else if (cached == DCACHE_NEGATIVE && (*next_level != '\0' || !need_empty)) {
+            state = FIND_EMPTY;  // 缓存的负项，不需要空目录项的位置
+        } else if (level == 0) {
             // 如果是第一级，需要从根目录开始搜索
             // DONE: 1.1 设置根目录的扇区号和扇区数（请给下面两个变量赋值，根目录的扇区号和扇区数可以在 meta 里的字段找到。）
             sector_t root_sec = meta.root_sec;
             size_t nsec = meta.root_sectors;
             // 使用 find_entry_in_sectors 寻找相应的目录项
-            state = find_entry_in_sectors(*remains, len, root_sec, nsec, slot);
-            if (state != FIND_EXIST) {
-                // 根目录项中没找到第一级路径，直接返回
+            state = find_entry_in_sectors(fatname, root_sec, nsec, slot);
+            if (state < 0) {  // 读目录出错，不能缓存为负项
                 return state;
             }
+            if (cacheable) {
+                dcache_insert(parent, shortname, state == FIND_EXIST ? slot : NULL, gen);
+            }
         } else {
             // 不是第一级，在目录对应的簇中寻找（在上一级中已将 clus 设为第一个簇）
             while (is_cluster_inuse(clus)) {  // 依次查找每个簇
                 // DONE: 1.2 在 clus 对应的簇中查找每个目录项。
                 // 你可以使用 state = find_entry_in_sectors(.....)，参考第一级中是如何查找的。
-                state = find_entry_in_sectors(*remains, len, cluster_first_sector(clus), meta.sec_per_clus, slot);
+                state = find_entry_in_sectors(fatname, cluster_first_sector(clus), meta.sec_per_clus, slot);
                 if (state < 0) {  // 出现错误
                     return state;
                 } else if (state == FIND_EXIST || state == FIND_EMPTY) {
                     break;  // 该级找到了，或者已经找完了有内容的项，不需要往后继续查找该级后面的簇
                 }
-                clus = read_fat_entry(clus);  // 记得实现该函数
+                clus = fat_next(clus);  // 记得实现该函数
+            }
+            if (cacheable) {
+                dcache_insert(parent, shortname, state == FIND_EXIST ? slot : NULL, gen);
             }
         }
-        // 下一级目录开始位置
-        const char* next_level = *remains + len;
-        next_level += strspn(next_level, "/");
 
         if (state == FIND_EXIST) {
             // 该级找到的情况，remains 后移至下一级
@@ -350,7 +660,7 @@ int find_entry_internal(const char* path, DirEntrySlot* slot, const char** remai
  */
 int find_entry(const char* path, DirEntrySlot* slot) {
     const char* remains = NULL;
-    int ret = find_entry_internal(path, slot, &remains);
+    int ret = find_entry_internal(path, slot, &remains, false);
     if (ret < 0) {
         return ret;
     }
@@ -360,6 +670,227 @@ int find_entry(const char* path, DirEntrySlot* slot) {
     return -ENOENT;
 }
 
+/**
+ * @brief 打开的文件。fat16_open 时创建并保存在 fi->fh 中，缓存了文件的目录项和簇号数组，
+ *        读写任意偏移都能直接找到对应的簇，不需要再查找路径、遍历簇链。
+ *        同一个文件多次打开时共用一个句柄（按目录项位置查找），修改文件的操作都通过它进行。
+ *        lock 保护目录项和簇号数组：读文件时加读锁，写文件、截断、删除时加写锁，不同文件的读写可以并行。
+ */
+typedef struct FileHandle {
+    DirEntrySlot slot;          // 文件的目录项
+    cluster_t* clusters;        // clusters[i] 为文件的第 i 个簇
+    size_t nclus;               // 文件的簇数
+    size_t cap;                 // clusters 的容量
+    int refs;                   // 引用次数，为 0 时释放，由 handles_lock 保护
+    bool unlinked;              // 文件已被删除
+    pthread_rwlock_t lock;
+    pthread_mutex_t ra_lock;    // 保护下面的预读状态，同一文件的多个读者可能同时更新它
+    off_t ra_next;              // 顺序读时下一次读取的偏移
+    size_t ra_window;           // 预读窗口（簇数），为 0 表示未检测到顺序读
+    size_t ra_end;              // 已发出预读请求的簇下标上界（不含）
+    struct FileHandle* next;    // 打开文件链表
+} FileHandle;
+
+#define RA_MIN 4                // 检测到顺序读时的初始预读簇数
+#define RA_MAX 64               // 预读窗口的最大簇数
+
+static FileHandle* open_files;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;  // 保护 open_files 链表和句柄的引用计数
+
+static int handle_reserve(FileHandle* h, size_t n) {
+    if (n <= h->cap) {
+        return 0;
+    }
+    size_t cap = max(n, h->cap * 2);
+    cluster_t* clusters = realloc(h->clusters, cap * sizeof(cluster_t));
+    if (clusters == NULL) {
+        return -ENOMEM;
+    }
+    h->clusters = clusters;
+    h->cap = cap;
+    return 0;
+}
+
+// 从 clus 开始沿簇链把簇号追加到 h->clusters，需持有 fat_lock
+static int handle_append_chain(FileHandle* h, cluster_t clus) {
+    for (; is_cluster_inuse(clus); clus = read_fat_entry(clus)) {
+        if (handle_reserve(h, h->nclus + 1) < 0) {
+            return -ENOMEM;
+        }
+        h->clusters[h->nclus++] = clus;
+    }
+    return 0;
+}
+
+// 查找目录项位于 slot 的已打开文件，需持有 handles_lock
+static FileHandle* handle_find(const DirEntrySlot* slot) {
+    for (FileHandle* h = open_files; h != NULL; h = h->next) {
+        if (!h->unlinked && h->slot.sector == slot->sector && h->slot.offset == slot->offset) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 重新读取 slot 位置上的目录项。查找路径之后其它线程可能已经修改或删除了这个文件，
+ *        在持有 handles_lock、文件没有打开的句柄时调用，得到的就是最新的目录项。
+ *
+ * @return int 成功返回 0，该位置已经不是原来的文件时返回 -ENOENT
+ */
+static int slot_refresh(DirEntrySlot* slot) {
+    char sector_buffer[PHYSICAL_SECTOR_SIZE];
+    if (bcache_read(slot->sector, sector_buffer) != 0) {
+        return -EIO;
+    }
+    const DIR_ENTRY* dir = (const DIR_ENTRY*)(sector_buffer + slot->offset);
+    if (memcmp(dir->DIR_Name, slot->dir.DIR_Name, FAT_NAME_LEN) != 0) {
+        return -ENOENT;
+    }
+    slot->dir = *dir;
+    return 0;
+}
+
+/**
+ * @brief 取得 slot 对应文件的句柄：文件已打开时返回共用的句柄，否则新建一个。用完后调用 handle_put 释放。
+ *
+ * @return int 成功返回 0
+ */
+static int handle_get(const DirEntrySlot* slot, FileHandle** out) {
+    int ret = 0;
+    pthread_mutex_lock(&handles_lock);
+    FileHandle* h = handle_find(slot);
+    if (h == NULL) {
+        h = calloc(1, sizeof(FileHandle));
+        if (h == NULL) {
+            pthread_mutex_unlock(&handles_lock);
+            return -ENOMEM;
+        }
+        h->slot = *slot;
+        ret = slot_refresh(&h->slot);
+        if (ret == 0) {
+            pthread_rwlock_rdlock(&fat_lock);
+            ret = handle_append_chain(h, h->slot.dir.DIR_FstClusLO);
+            pthread_rwlock_unlock(&fat_lock);
+        }
+        if (ret < 0) {
+            pthread_mutex_unlock(&handles_lock);
+            free(h->clusters);
+            free(h);
+            return ret;
+        }
+        pthread_rwlock_init(&h->lock, NULL);
+        pthread_mutex_init(&h->ra_lock, NULL);
+        h->next = open_files;
+        open_files = h;
+    }
+    h->refs++;
+    pthread_mutex_unlock(&handles_lock);
+    *out = h;
+    return 0;
+}
+
+static void handle_put(FileHandle* h) {
+    pthread_mutex_lock(&handles_lock);
+    if (--h->refs > 0) {
+        pthread_mutex_unlock(&handles_lock);
+        return;
+    }
+    for (FileHandle** p = &open_files; *p != NULL; p = &(*p)->next) {
+        if (*p == h) {
+            *p = h->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&handles_lock);
+    pthread_rwlock_destroy(&h->lock);
+    pthread_mutex_destroy(&h->ra_lock);
+    free(h->clusters);
+    free(h);
+}
+
+/**
+ * @brief 取得文件操作要用的句柄：优先使用 fi 中打开时保存的句柄，没有时（例如 truncate 命令）按路径查找。
+ *        用完后调用 handle_put 释放。
+ *
+ * @return int 成功返回 0，失败返回 POSIX 错误代码的负值
+ */
+static int handle_of(const char* path, struct fuse_file_info* fi, FileHandle** out) {
+    if (fi != NULL && fi->fh != 0) {
+        *out = (FileHandle*)(uintptr_t)fi->fh;
+        pthread_mutex_lock(&handles_lock);
+        (*out)->refs++;
+        pthread_mutex_unlock(&handles_lock);
+        return 0;
+    }
+    DirEntrySlot slot;
+    int ret = find_entry(path, &slot);
+    if (ret < 0) {
+        return ret;
+    }
+    if (is_directory(slot.dir.DIR_Attr)) {
+        return -EISDIR;
+    }
+    return handle_get(&slot, out);
+}
+
+// 从文件的第 i 个簇开始，找出磁盘上连续、且覆盖簇内偏移 offset 之后 size 字节所需的最后一个簇的下标
+static size_t handle_run_end(const FileHandle* h, size_t i, size_t offset, size_t size) {
+    size_t last = i;
+    while (last + 1 < h->nclus && offset + size > (last - i + 1) * meta.cluster_size &&
+           h->clusters[last + 1] == h->clusters[last] + 1) {
+        last++;
+    }
+    return last;
+}
+
+/**
+ * @brief 顺序读检测与预读，在读取数据之前调用。本次读取从上次读取结束处开始时视为顺序读，
+ *        预读窗口从 RA_MIN 个簇开始每次翻倍直到 RA_MAX；随机读时窗口清零。
+ *        要读的簇还没有被预读过时（刚开始顺序读，或者读得比预读快），在本线程把这次要读的簇
+ *        连同之后 ra_window 个簇一起读入缓存；已预读的部分用掉一半后，把之后的窗口交给后台线程异步预读。
+ *
+ * @param offset 本次读取的偏移
+ * @param size   本次要读取的字节数
+ */
+static void handle_readahead(FileHandle* h, off_t offset, size_t size) {
+    size_t i = 0, end = 0;
+    bool sync = false;
+    pthread_mutex_lock(&h->ra_lock);
+    if (offset == h->ra_next && size > 0) {
+        h->ra_window = h->ra_window == 0 ? RA_MIN : min(h->ra_window * 2, RA_MAX);
+    } else {
+        h->ra_window = 0;
+        h->ra_end = 0;
+    }
+    h->ra_next = offset + size;
+    if (h->ra_window > 0) {
+        size_t first = offset / meta.cluster_size;
+        size_t last = (offset + size - 1) / meta.cluster_size;
+        sync = h->ra_end <= first;
+        // 已预读的部分还剩一半以上时不发新请求，攒成较大的一段再读，减少磁头来回移动
+        if (sync || h->ra_end <= last + 1 + h->ra_window / 2) {
+            i = sync ? first : max(h->ra_end, last + 1);
+            end = min(last + 1 + h->ra_window, h->nclus);
+            h->ra_end = max(h->ra_end, end);
+        }
+    }
+    pthread_mutex_unlock(&h->ra_lock);
+    // 磁盘上连续的簇合并为一个请求。调用者持有 h->lock 读锁，簇号数组不会改变
+    while (i < end) {
+        size_t j = i + 1;
+        while (j < end && h->clusters[j] == h->clusters[j - 1] + 1) {
+            j++;
+        }
+        if (sync) {
+            bcache_read_sectors(cluster_first_sector(h->clusters[i]), (j - i) * meta.sec_per_clus, NULL);
+        } else {
+            bcache_prefetch(cluster_first_sector(h->clusters[i]), (j - i) * meta.sec_per_clus);
+        }
+        i = j;
+    }
+}
+
 /**
  * @brief 创建目录、创建文件时使用，找到一个空槽，并且顺便检查是否有重名文件 / 目录。
  *
@@ -369,7 +900,7 @@ int find_entry(const char* path, DirEntrySlot* slot) {
  * @return int
  */
 int find_empty_slot(const char* path, DirEntrySlot* slot, const char** last_name) {
-    int ret = find_entry_internal(path, slot, last_name);
+    int ret = find_entry_internal(path, slot, last_name, true);
     if (ret < 0) {
         return ret;
     }
@@ -382,6 +913,95 @@ int find_empty_slot(const char* path, DirEntrySlot* slot, const char** last_name
     return 0;
 }
 
+/* 目录锁：在目录中创建、删除目录项时持有该目录的锁，避免两个线程选中同一个空槽或创建同名的文件，
+   也避免在正在被删除的目录中创建文件。按目录的首簇号（根目录为 0）散列到 DIR_LOCKS 个锁上。 */
+#define DIR_LOCKS 64
+static pthread_mutex_t dir_locks[DIR_LOCKS];
+
+/* 目录项扇区锁：一个扇区中有多个文件的目录项，不同文件的写操作会同时读出、修改、写回同一个扇区，
+   dir_entry_write 持有扇区对应的锁，避免互相覆盖。按扇区号散列到 ENTRY_LOCKS 个锁上。 */
+#define ENTRY_LOCKS 64
+static pthread_mutex_t entry_locks[ENTRY_LOCKS];
+
+// 找到 path 的父目录的首簇号，self 为 true 时 dirs[1] 返回 path 自己（必须是目录）的首簇号
+static int resolve_dirs(const char* path, bool self, cluster_t dirs[2]) {
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') len--;
+    while (len > 0 && path[len - 1] != '/') len--;
+    while (len > 0 && path[len - 1] == '/') len--;
+    DirEntrySlot slot;
+    dirs[0] = 0;
+    if (len > 0) {
+        char* parent = strndup(path, len);
+        if (parent == NULL) {
+            return -ENOMEM;
+        }
+        int ret = find_entry(parent, &slot);
+        free(parent);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!is_directory(slot.dir.DIR_Attr)) {
+            return -ENOTDIR;
+        }
+        dirs[0] = slot.dir.DIR_FstClusLO;
+    }
+    if (self) {
+        int ret = find_entry(path, &slot);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!is_directory(slot.dir.DIR_Attr)) {
+            return -ENOTDIR;
+        }
+        dirs[1] = slot.dir.DIR_FstClusLO;
+    }
+    return 0;
+}
+
+static void unlock_dirs(pthread_mutex_t* locks[2]) {
+    if (locks[1] != locks[0]) {
+        pthread_mutex_unlock(locks[1]);
+    }
+    pthread_mutex_unlock(locks[0]);
+}
+
+/**
+ * @brief 给 path 的父目录加锁，self 为 true 时同时给 path 自己加锁。两个锁按地址顺序加，避免死锁。
+ *        加锁前解析的目录可能已被其它线程删除，加锁后重新解析，不一致时重试。
+ *
+ * @param locks 返回加上的锁，之后用 unlock_dirs 释放
+ * @return int 成功返回 0，失败返回 POSIX 错误代码的负值（此时没有加锁）
+ */
+static int lock_dirs(const char* path, bool self, pthread_mutex_t* locks[2]) {
+    while (true) {
+        cluster_t dirs[2] = {0, 0}, again[2] = {0, 0};
+        int ret = resolve_dirs(path, self, dirs);
+        if (ret < 0) {
+            return ret;
+        }
+        locks[0] = &dir_locks[dirs[0] % DIR_LOCKS];
+        locks[1] = self ? &dir_locks[dirs[1] % DIR_LOCKS] : locks[0];
+        if (locks[0] > locks[1]) {
+            pthread_mutex_t* t = locks[0];
+            locks[0] = locks[1];
+            locks[1] = t;
+        }
+        pthread_mutex_lock(locks[0]);
+        if (locks[1] != locks[0]) {
+            pthread_mutex_lock(locks[1]);
+        }
+        ret = resolve_dirs(path, self, again);
+        if (ret == 0 && dirs[0] == again[0] && dirs[1] == again[1]) {
+            return 0;
+        }
+        unlock_dirs(locks);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
 mode_t get_mode_from_attr(uint8_t attr) {
     mode_t mode = 0;
     mode |= is_readonly(attr) ? S_IRUGO : S_NORMAL;
@@ -405,7 +1025,8 @@ void time_fat_to_unix(struct timespec* ts, uint16_t date, uint16_t time, uint16_
 }
 
 void time_unix_to_fat(const struct timespec* ts, uint16_t* date, uint16_t* time, uint8_t* acc_time) {
-    struct tm* t = gmtime(&(ts->tv_sec));
+    struct tm tm_buf;  // 多线程下不能使用 gmtime 的静态缓冲区
+    struct tm* t = gmtime_r(&(ts->tv_sec), &tm_buf);
     *date = 0;
     *date |= ((t->tm_year - 80) << 9);
     *date |= ((t->tm_mon + 1) << 5);
@@ -435,7 +1056,11 @@ void time_unix_to_fat(const struct timespec* ts, uint16_t* date, uint16_t* time,
 void* fat16_init(struct fuse_conn_info* conn, struct fuse_config* config) {
     /* Reads the BPB */
     BPB_BS bpb;
-    sector_read(0, &bpb);
+    if (bcache_init() < 0) {
+        fprintf(stderr, "Init buffer cache failed.\n");
+        exit(ENOMEM);
+    }
+    bcache_read(0, &bpb);
 
     // DONE: 0.0 你无需修改这部分代码，但阅读这部分，并理解这些变量的含义有助于你理解文件系统的结构
     // 请同时参考 FAT16 结构体的定义里的注释（本文件第 15 行开始）
@@ -454,6 +1079,18 @@ void* fat16_init(struct fuse_conn_info* conn, struct fuse_config* config) {
     meta.clusters = (meta.sectors - meta.data_sec) / meta.sec_per_clus;
     meta.cluster_size = meta.sec_per_clus * meta.sector_size;
 
+    if (fat_load() < 0) {
+        fprintf(stderr, "Load FAT failed.\n");
+        exit(EIO);
+    }
+    dcache_init();
+    for (int i = 0; i < DIR_LOCKS; i++) {
+        pthread_mutex_init(&dir_locks[i], NULL);
+    }
+    for (int i = 0; i < ENTRY_LOCKS; i++) {
+        pthread_mutex_init(&entry_locks[i], NULL);
+    }
+
     // 以下可忽略
     meta.fs_uid = getuid();
     meta.fs_gid = getgid();
@@ -465,11 +1102,34 @@ void* fat16_init(struct fuse_conn_info* conn, struct fuse_config* config) {
 }
 
 /**
- * @brief 释放文件系统，无需修改
+ * @brief 释放文件系统：写回缓冲区缓存
  *
  * @param data
  */
-void fat16_destroy(void* data) {}
+void fat16_destroy(void* data) {
+    bcache_destroy();  // FAT 表的修改在释放 fat_lock 时已经写入缓冲区缓存
+    printf("dcache: %lu hits, %lu misses\n", dcache.hits, dcache.misses);
+    free(fat_table);
+    free(fat_dirty);
+    free(free_map);
+    free(resv_map);
+    fat_table = NULL;
+    fat_dirty = NULL;
+    free_map = NULL;
+    resv_map = NULL;
+}
+
+/**
+ * @brief 将缓存的元数据写回磁盘
+ *
+ * @param path      忽略
+ * @param datasync  忽略
+ * @param fi        忽略
+ * @return int      成功返回 0
+ */
+int fat16_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+    return bcache_flush();  // FAT 表的修改在释放 fat_lock 时已经写入缓冲区缓存
+}
 
 /**
  * @brief 获取 path 对应的文件的属性，无需修改
@@ -586,7 +1246,9 @@ int fat16_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off
         // 你可以参考 find_entry_in_sectors 函数的实现。
         for (size_t i = 0; i < nsec; i++) {
             sector_t sec = first_sec + i;
-            sector_read(sec, sector_buffer);
+            if (bcache_read(sec, sector_buffer) != 0) {
+                return -EIO;
+            }
             // DONE: 1.5 对扇区中每个目录项：
             // 1. 确认其是否是表示文件或目录的项（排除 LFN、空项、删除项等不合法项的干扰）
             // 2. 从 FAT 文件名中，获得长文件名（可以使用提供的 to_longname 函数）
@@ -607,7 +1269,7 @@ int fat16_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off
             break;
         }
         // printf("- Cluster #%u: ", clus);
-        clus = read_fat_entry(clus);
+        clus = fat_next(clus);
         // printf("next #%u\n", clus);
     }
 
@@ -637,7 +1299,9 @@ int dir_empty(DIR_ENTRY* dir) {
         nsec = meta.sec_per_clus;
         for (size_t i = 0; (is_empty && (i < nsec)); i++) {
             sector_t sec = first_sec + i;
-            sector_read(sec, sector_buffer);
+            if (bcache_read(sec, sector_buffer) != 0) {
+                return -EIO;
+            }
             for (size_t offset = 0; offset < meta.sector_size; offset += DIR_ENTRY_SIZE) {
                 DIR_ENTRY* dir = (DIR_ENTRY*)(sector_buffer + offset);
                 if (is_valid(dir) && !is_dot(dir)) {
@@ -648,7 +1312,7 @@ int dir_empty(DIR_ENTRY* dir) {
                 }
             }
         }
-        clus = read_fat_entry(clus);
+        clus = fat_next(clus);
     }
     return is_empty;
 }
@@ -662,27 +1326,47 @@ int dir_empty(DIR_ENTRY* dir) {
  * @param size      要读取的数据长度
  * @return int
  */
-int read_from_cluster_at_offset(cluster_t clus, off_t offset, char* data, size_t size) {
-    // printf("Read clus %hd at offset %ld, size: %lu\n", clus, offset, size);
-    assert(offset + size <= meta.cluster_size);  // offset + size 必须小于簇大小
+/**
+ * @brief 从扇区 sec 开始的若干连续扇区中，读取偏移 offset 处的 size 字节。
+ *        首尾不完整的扇区单独读取，中间的整扇区用 bcache_read_sectors 一次读入 data。
+ *
+ * @return ssize_t 成功返回读取的字节数
+ */
+static ssize_t read_sectors_at(sector_t sec, size_t offset, char* data, size_t size) {
     char sector_buffer[PHYSICAL_SECTOR_SIZE];
-
-    uint32_t sec = cluster_first_sector(clus) + offset / meta.sector_size;
+    sec += offset / meta.sector_size;
     size_t sec_off = offset % meta.sector_size;
     size_t pos = 0;
-    while (pos < size) {
-        int ret = sector_read(sec, sector_buffer);
-        if (ret < 0)
-            return ret;
-        size_t len = min(meta.sector_size - sec_off, size - pos);
-        memcpy(data + pos, sector_buffer + sec_off, len);
-        pos += len;
-        sec_off = 0;
+    if (sec_off != 0 || size < meta.sector_size) {
+        if (bcache_read(sec, sector_buffer) != 0)
+            return -EIO;
+        pos = min(meta.sector_size - sec_off, size);
+        memcpy(data, sector_buffer + sec_off, pos);
         sec++;
     }
-    return size;
+    size_t whole = (size - pos) / meta.sector_size;
+    if (whole > 0) {
+        if (bcache_read_sectors(sec, whole, data + pos) != 0)
+            return -EIO;
+        pos += whole * meta.sector_size;
+        sec += whole;
+    }
+    if (pos < size) {
+        if (bcache_read(sec, sector_buffer) != 0)
+            return -EIO;
+        memcpy(data + pos, sector_buffer, size - pos);
+        pos = size;
+    }
+    return pos;
 }
 
+int read_from_cluster_at_offset(cluster_t clus, off_t offset, char* data, size_t size) {
+    // printf("Read clus %hd at offset %ld, size: %lu\n", clus, offset, size);
+    assert(offset + size <= meta.cluster_size);  // offset + size 必须小于簇大小
+    return read_sectors_at(cluster_first_sector(clus), offset, data, size);
+}
+
+
 /**
  * @brief 从 path 对应的文件的 offset 字节处开始读取 size 字节的数据到 buffer 中，并返回实际读取的字节数。
  * Hint: 文件大小属性是 Dir.DIR_FileSize。
@@ -700,44 +1384,83 @@ int fat16_read(const char* path, char* buffer, size_t size, off_t offset, struct
         return -EISDIR;
     }
 
-    DirEntrySlot slot;
-    DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);
+    FileHandle* h;
+    int ret = handle_of(path, fi, &h);
     if (ret < 0) {
         return ret;
     }
-    if (is_directory(dir->DIR_Attr)) {
-        return -EISDIR;
-    }
+    pthread_rwlock_rdlock(&h->lock);
+    DIR_ENTRY* dir = &(h->slot.dir);
     if (offset > dir->DIR_FileSize) {
+        pthread_rwlock_unlock(&h->lock);
+        handle_put(h);
         return -EINVAL;
     }
     size = min(size, dir->DIR_FileSize - offset);
+    handle_readahead(h, offset, size);
 
-    cluster_t clus = dir->DIR_FstClusLO;
+    // DONE: 1.6 从正确的簇中读取数据。
+    // 句柄中缓存了文件的簇号数组，直接定位到 offset 所在的簇；磁盘上连续的簇合并为一段，一次读取
+    size_t i = offset / meta.cluster_size;
+    size_t clus_off = offset % meta.cluster_size;
     size_t p = 0;
-    // DONE: 1.6 clus 初始为该文件第一个簇，利用 read_from_cluster_at_offset 函数，从正确的簇中读取数据。
-    // Hint: 需要注意 offset 的位置，和结束读取的位置。要读取的数据可能横跨多个簇，也可能就在一个簇的内部。
-    // 你可以参考 read_from_cluster_at_offset 里，是怎么处理每个扇区的读取范围的，或者用自己的方式解决这个问题。
-    // printf("[fat16_read] file size: %d, read size: %ld\n", dir->DIR_FileSize, size);
-    while (p < size) {
-        // printf("- Cluster #%u: offset %ld", clus, offset);
-        if (offset > meta.cluster_size) {
-            offset -= meta.cluster_size;
-        } else {
-            ret = read_from_cluster_at_offset(clus, offset, buffer + p, min(size - p, meta.cluster_size - offset));
-            // printf(", read %d", ret);
-            p += ret;
-            offset = 0;
+    while (p < size && i < h->nclus) {
+        size_t last = handle_run_end(h, i, clus_off, size - p);
+        size_t len = min(size - p, (last - i + 1) * meta.cluster_size - clus_off);
+        ret = read_sectors_at(cluster_first_sector(h->clusters[i]), clus_off, buffer + p, len);
+        if (ret < 0) {
+            pthread_rwlock_unlock(&h->lock);
+            handle_put(h);
+            return ret;
         }
-        clus = read_fat_entry(clus);
-        // printf(", next #%u\n", clus);
+        p += ret;
+        clus_off = 0;
+        i = last + 1;
     }
-    // printf("- Total read: %ld\n", p);
-
+    pthread_rwlock_unlock(&h->lock);
+    handle_put(h);
     return p;
 }
 
+/**
+ * @brief 打开 path 对应的文件，把句柄保存在 fi->fh 中
+ *
+ * @return int 成功返回 0，失败返回 POSIX 错误代码的负值
+ */
+int fat16_open(const char* path, struct fuse_file_info* fi) {
+    printf("open(path='%s')\n", path);
+    if (path_is_root(path)) {
+        return -EISDIR;
+    }
+    DirEntrySlot slot;
+    int ret = find_entry(path, &slot);
+    if (ret < 0) {
+        return ret;
+    }
+    if (is_directory(slot.dir.DIR_Attr)) {
+        return -EISDIR;
+    }
+    FileHandle* h;
+    ret = handle_get(&slot, &h);
+    if (ret < 0) {
+        return ret;
+    }
+    fi->fh = (uintptr_t)h;
+    return 0;
+}
+
+/**
+ * @brief 关闭文件，释放 fat16_open 中取得的句柄
+ */
+int fat16_release(const char* path, struct fuse_file_info* fi) {
+    printf("release(path='%s')\n", path);
+    if (fi->fh != 0) {
+        handle_put((FileHandle*)(uintptr_t)fi->fh);
+        fi->fh = 0;
+    }
+    return 0;
+}
+
 // ------------------TASK2: 创建/删除文件-----------------------------------
 
 /**
@@ -753,11 +1476,20 @@ int dir_entry_write(DirEntrySlot slot) {
     //  1. 读取 slot.dir 所在的扇区
     //  2. 将目录项写入 buffer 对应的位置（Hint: 使用 memcpy）
     //  3. 将整个扇区完整写回
-    int ret = sector_read(slot.sector, sector_buffer);
-    if (ret != 0) // 读取错误
+    pthread_mutex_t* lock = &entry_locks[slot.sector % ENTRY_LOCKS];
+    pthread_mutex_lock(lock);
+    int ret = bcache_read(slot.sector, sector_buffer);
+    if (ret != 0) { // 读取错误
+        pthread_mutex_unlock(lock);
         return ret;
+    }
+    uint8_t old_name[FAT_NAME_LEN];
+    memcpy(old_name, ((DIR_ENTRY*)(sector_buffer + slot.offset))->DIR_Name, FAT_NAME_LEN);
     memcpy(sector_buffer + slot.offset, &(slot.dir), DIR_ENTRY_SIZE);
-    sector_write(slot.sector, sector_buffer);
+    bcache_write(slot.sector, sector_buffer);
+    // 写入之后再更新目录项缓存：之前开始的查找可能读到旧内容，版本号变化后它们的结果不会被缓存
+    dcache_update(old_name, &slot);
+    pthread_mutex_unlock(lock);
     return 0;
 }
 
@@ -793,28 +1525,63 @@ int dir_entry_create(DirEntrySlot slot, const char* shortname, attr_t attr, clus
  * @param clus      要写入表项的簇号
  * @param data      要写入表项的数据，如下一个簇号，CLUSTER_END（文件末尾），或者 0（释放该簇）等等
  * @return int      成功返回 0
+ * @note 修改 FAT 表的函数（write_fat_entry、free_clusters、alloc_clusters_after）调用者都需持有 fat_lock 写锁，
+ *       并用 fat_write_unlock 释放
  */
 int write_fat_entry(cluster_t clus, cluster_t data) {
-    char sector_buffer[MAX_LOGICAL_SECTOR_SIZE];
-    size_t clus_off = clus * sizeof(cluster_t);
-    sector_t clus_sec = clus_off / meta.sector_size;
-    size_t sec_off = clus_off % meta.sector_size;
-    sector_t sector = meta.reserved;
-    for (size_t i = 0; i < meta.fats; i++) {
-        // DONE: 2.2 修改第 i 个 FAT 表中，clus_sec 扇区中，sec_off 偏移处的表项，使其值为 data
-        //   1. 计算第 i 个 FAT 表所在扇区，进一步计算 clus 对应的 FAT 表项所在扇区
-        //   2. 读取该扇区并在对应位置写入数据
-        //   3. 将该扇区写回
-        sector += clus_sec;
-        sector_read(sector, sector_buffer);
-        memcpy(sector_buffer + sec_off, &data, sizeof(data) / sizeof(char));
-        sector_write(sector, sector_buffer);
+    // 修改 FAT 表缓存，并标记表项所在扇区为脏，由 fat_flush 写回所有 FAT 表
+    bool was_free = fat_table[clus] == CLUSTER_FREE, now_free = data == CLUSTER_FREE;
+    if (was_free != now_free && CLUSTER_MIN <= clus && clus < fat_entries) {
+        free_map_set(clus, now_free);
     }
+    fat_table[clus] = data;
+    fat_dirty[clus * sizeof(cluster_t) / meta.sector_size] = 1;
     return 0;
 }
 
+static void window_release(AllocWindow* w) {
+    for (cluster_t clus = w->next; clus < w->end; clus++) {
+        bit_assign(resv_map, clus, false);
+    }
+    w->next = w->end = 0;
+}
+
+static AllocWindow* window_find(cluster_t next) {
+    for (int i = 0; i < ALLOC_WINDOWS; i++) {
+        if (windows[i].next < windows[i].end && windows[i].next == next) {
+            return &windows[i];
+        }
+    }
+    return NULL;
+}
+
+static void window_open(cluster_t start, size_t len) {
+    AllocWindow* victim = &windows[0];
+    for (int i = 0; i < ALLOC_WINDOWS; i++) {
+        if (windows[i].next == windows[i].end) {
+            victim = &windows[i];
+            break;
+        }
+        if (windows[i].stamp < victim->stamp) {
+            victim = &windows[i];
+        }
+    }
+    window_release(victim);
+    victim->next = start;
+    victim->end = start + len;
+    victim->stamp = ++window_clock;
+    for (cluster_t clus = victim->next; clus < victim->end; clus++) {
+        bit_assign(resv_map, clus, true);
+    }
+}
+
 int free_clusters(cluster_t clus) {
     while (is_cluster_inuse(clus)) {
+        // 文件的这一部分不再存在，紧跟其后的预分配窗口也就没有主人了
+        AllocWindow* w = window_find(clus + 1);
+        if (w != NULL) {
+            window_release(w);
+        }
         cluster_t next = read_fat_entry(clus);
         int ret = write_fat_entry(clus, CLUSTER_FREE);
         if (ret < 0) {
@@ -830,7 +1597,7 @@ int cluster_clear(cluster_t clus) {
     sector_t first_sec = cluster_first_sector(clus);
     for (size_t i = 0; i < meta.sec_per_clus; i++) {
         sector_t sec = first_sec + i;
-        int ret = sector_write(sec, ZERO_SECTOR);
+        int ret = bcache_write(sec, ZERO_SECTOR);
         if (ret < 0) {
             return ret;
         }
@@ -838,33 +1605,112 @@ int cluster_clear(cluster_t clus) {
     return 0;
 }
 
+/**
+ * @brief 从 free_hint 开始（到末尾后回绕）查找长度至少为 want 的最短可分配连续段（最佳适应），
+ *        没有这样的段时返回最长的一段
+ *
+ * @param want 希望的长度
+ * @param len  返回找到的段的长度，没有可分配的簇时为 0
+ * @return cluster_t 段的第一个簇号
+ */
+static cluster_t find_run(size_t want, size_t* len) {
+    cluster_t best = 0;
+    size_t best_len = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        cluster_t clus = pass == 0 ? free_hint : CLUSTER_MIN;
+        cluster_t limit = pass == 0 ? fat_entries : free_hint;
+        while ((clus = avail_scan(clus, true)) < limit) {
+            cluster_t end = min(avail_scan(clus, false), limit);
+            size_t run = end - clus;
+            bool better = best_len < want ? run > best_len : (run >= want && run < best_len);
+            if (better) {
+                best = clus;
+                best_len = run;
+                if (run == want) {
+                    goto found;
+                }
+            }
+            clus = end;
+        }
+    }
+found:
+    *len = best_len;
+    return best;
+}
+
+// 占用簇 clus，先标记为文件结束，分配完成后再连成簇链
+static void take_cluster(cluster_t clus, cluster_t* clusters, size_t* allocated) {
+    bit_assign(resv_map, clus, false);
+    write_fat_entry(clus, CLUSTER_END);
+    clusters[(*allocated)++] = clus;
+}
+
 /**
  * @brief 分配 n 个空闲簇，分配过程中将 n 个簇通过 FAT 表项连在一起，然后返回第一个簇的簇号。
  *        最后一个簇的 FAT 表项将会指向 0xFFFF（即文件中止）。
- * @param fat16_ins 文件系统指针
- * @param n         要分配簇的个数
- * @return int      成功返回 0，失败返回错误代码负值
+ *        为了减少磁头移动，新簇尽量紧跟在 last 之后：
+ *        1. last 之后有该文件的预分配窗口时，从窗口中分配；
+ *        2. 否则 last 的下一个簇可分配时，直接向后扩展；
+ *        3. 否则用最佳适应找一段足够长的连续空闲簇，window 为 true 时在这里为文件开一个新窗口；
+ *           没有足够长的段时使用最长的一段，没有未被预留的空闲簇时收回所有窗口。
+ * @param last       文件当前的最后一个簇，文件还没有簇时为 CLUSTER_END
+ * @param n          要分配簇的个数
+ * @param window     是否为文件预留窗口，只有会继续增长的普通文件才需要
+ * @param first_clus 返回第一个簇的簇号
+ * @return int       成功返回 0，失败返回错误代码负值
  */
-int alloc_clusters(size_t n, cluster_t* first_clus) {
+int alloc_clusters_after(cluster_t last, size_t n, size_t window, cluster_t* first_clus) {
     if (n == 0)
         return CLUSTER_END;
 
+    if (n > free_count) {  // 空闲簇不足，分配失败
+        return -ENOSPC;
+    }
+
     // 用于保存找到的 n 个空闲簇，另外在末尾加上 CLUSTER_END，共 n+1 个簇号
     cluster_t* clusters = malloc((n + 1) * sizeof(cluster_t));
+    if (clusters == NULL) {
+        return -ENOMEM;
+    }
     size_t allocated = 0;  // 已找到的空闲簇个数
 
-    // DONE: 2.3 扫描 FAT 表，找到 n 个空闲的簇，存入 cluster 数组。注意此时不需要修改对应的 FAT 表项。
-    // Hint: 你可以使用 read_fat_entry 函数来读取 FAT 表项的值，根据该值判断簇是否空闲。
-    for (cluster_t clus = CLUSTER_MIN; ((allocated < n) && (clus <= CLUSTER_MAX)); clus++) {
-        if (read_fat_entry(clus) == CLUSTER_FREE) {
-            printf("[alloc_clusters] Allocated cluster #%x.\n", clus);
-            clusters[allocated++] = clus;
+    // DONE: 2.3 扫描 FAT 表，找到 n 个空闲的簇，存入 cluster 数组。
+    cluster_t goal = is_cluster_inuse(last) ? last + 1 : 0;  // 希望分配的下一个簇
+    while (allocated < n) {
+        size_t need = n - allocated;
+        AllocWindow* w = goal != 0 ? window_find(goal) : NULL;
+        if (w != NULL) {
+            while (allocated < n && w->next < w->end) {
+                take_cluster(w->next++, clusters, &allocated);
+            }
+            w->stamp = ++window_clock;
+            goal = w->next;
+            continue;
         }
-    }
-
-    if (allocated != n) {  // 找不到 n 个簇，分配失败
-        free(clusters);
-        return -ENOSPC;
+        if (goal != 0 && goal < fat_entries && bit_test(free_map, goal) && !bit_test(resv_map, goal)) {
+            take_cluster(goal++, clusters, &allocated);
+            continue;
+        }
+        size_t want = max(need, window);
+        size_t len;
+        cluster_t start = find_run(want, &len);
+        if (len == 0) {  // 剩下的空闲簇都被预留了
+            for (int i = 0; i < ALLOC_WINDOWS; i++) {
+                window_release(&windows[i]);
+            }
+            continue;
+        }
+        if (window > 0 && len > need) {
+            len = min(len, want);
+            window_open(start, len);
+        } else {
+            len = min(len, need);
+            for (cluster_t clus = start; clus < start + len; clus++) {
+                take_cluster(clus, clusters, &allocated);
+            }
+        }
+        goal = start;
+        free_hint = start + len;
     }
 
     // 找到了 n 个空闲簇，将 CLUSTER_END 加至末尾。
@@ -875,6 +1721,9 @@ int alloc_clusters(size_t n, cluster_t* first_clus) {
     for (size_t i = 0; i < n; i++) {
         int ret = cluster_clear(clusters[i]);
         if (ret < 0) {
+            for (size_t j = 0; j < n; j++) {
+                write_fat_entry(clusters[j], CLUSTER_FREE);
+            }
             free(clusters);
             return ret;
         }
@@ -891,6 +1740,13 @@ int alloc_clusters(size_t n, cluster_t* first_clus) {
     return 0;
 }
 
+/**
+ * @brief 分配 n 个空闲簇，不紧跟任何已有的簇，也不预留窗口（用于目录等）
+ */
+int alloc_clusters(size_t n, cluster_t* first_clus) {
+    return alloc_clusters_after(CLUSTER_END, n, 0, first_clus);
+}
+
 /**
  * @brief 在 path 对应的路径创建新文件 （请阅读函数的逻辑，补全 find_empty_slot 和 dir_entry_create 两个函数）
  *
@@ -899,8 +1755,7 @@ int alloc_clusters(size_t n, cluster_t* first_clus) {
  * @param devNum  忽略，要创建文件的设备的设备号
  * @return int    成功返回 0，失败返回 POSIX 错误代码的负值
  */
-int fat16_mknod(const char* path, mode_t mode, dev_t dev) {
-    printf("mknod(path='%s', mode=%03o, dev=%lu)\n", path, mode, dev);
+static int mknod_locked(const char* path) {
     DirEntrySlot slot;
     const char* filename = NULL;
     int ret = find_empty_slot(path, &slot, &filename);
@@ -921,14 +1776,37 @@ int fat16_mknod(const char* path, mode_t mode, dev_t dev) {
     return 0;
 }
 
+int fat16_mknod(const char* path, mode_t mode, dev_t dev) {
+    printf("mknod(path='%s', mode=%03o, dev=%lu)\n", path, mode, dev);
+    // 查找空槽到写入目录项期间持有父目录的锁
+    pthread_mutex_t* locks[2];
+    int ret = lock_dirs(path, false, locks);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = mknod_locked(path);
+    unlock_dirs(locks);
+    return ret;
+}
+
+/**
+ * @brief 创建并打开 path 对应的文件
+ */
+int fat16_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+    int ret = fat16_mknod(path, mode, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    return fat16_open(path, fi);
+}
+
 /**
  * @brief 删除 path 对应的文件（请阅读函数逻辑，补全 free_clusters 和 dir_entry_write）
  *
  * @param path  要删除的文件路径
  * @return int  成功返回 0，失败返回 POSIX 错误代码的负值
  */
-int fat16_unlink(const char* path) {
-    printf("unlink(path='%s')\n", path);
+static int unlink_locked(const char* path) {
     DirEntrySlot slot;
     DIR_ENTRY* dir = &(slot.dir);
     int ret = find_entry(path, &slot);
@@ -938,18 +1816,52 @@ int fat16_unlink(const char* path) {
     if (is_directory(dir->DIR_Attr)) {
         return -EISDIR;
     }
-    ret = free_clusters(dir->DIR_FstClusLO);
+    // 持有 handles_lock 直到目录项被删除，期间不会有新的句柄打开这个文件
+    pthread_mutex_lock(&handles_lock);
+    FileHandle* h = handle_find(&slot);
+    if (h != NULL) {  // 文件仍被打开，之后通过句柄的读写都视为空文件
+        pthread_rwlock_wrlock(&h->lock);
+        slot = h->slot;
+        h->unlinked = true;
+        h->nclus = 0;
+        h->slot.dir.DIR_FstClusLO = CLUSTER_END;
+        h->slot.dir.DIR_FileSize = 0;
+    } else {
+        ret = slot_refresh(&slot);
+    }
+    cluster_t first_clus = dir->DIR_FstClusLO;
+    if (ret == 0) {
+        dir->DIR_Name[0] = NAME_DELETED;
+        ret = dir_entry_write(slot);
+    }
+    if (h != NULL) {
+        pthread_rwlock_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&handles_lock);
     if (ret < 0) {
         return ret;
     }
-    dir->DIR_Name[0] = NAME_DELETED;
-    ret = dir_entry_write(slot);
+    pthread_rwlock_wrlock(&fat_lock);
+    ret = free_clusters(first_clus);
+    fat_write_unlock();
     if (ret < 0) {
         return ret;
     }
     return 0;
 }
 
+int fat16_unlink(const char* path) {
+    printf("unlink(path='%s')\n", path);
+    pthread_mutex_t* locks[2];
+    int ret = lock_dirs(path, false, locks);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = unlink_locked(path);
+    unlock_dirs(locks);
+    return ret;
+}
+
 /**
  * @brief 修改 path 对应文件的时间戳，本次实验不做要求，可忽略该函数
  *
@@ -957,9 +1869,7 @@ int fat16_unlink(const char* path) {
  * @param tv    时间戳
  * @return int
  */
-int fat16_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
-    printf("utimens(path='%s', tv=[%ld.%09ld, %ld.%09ld])\n", path,
-           tv[0].tv_sec, tv[0].tv_nsec, tv[1].tv_sec, tv[1].tv_nsec);
+static int utimens_locked(const char* path, const struct timespec tv[2]) {
     DirEntrySlot slot;
     DIR_ENTRY* dir = &(slot.dir);
     int ret = find_entry(path, &slot);
@@ -967,9 +1877,25 @@ int fat16_utimens(const char* path, const struct timespec tv[2], struct fuse_fil
         return ret;
     }
 
-    time_unix_to_fat(&tv[1], &(dir->DIR_WrtDate), &(dir->DIR_WrtTime), NULL);
-    time_unix_to_fat(&tv[0], &(dir->DIR_LstAccDate), NULL, NULL);
-    ret = dir_entry_write(slot);
+    // 文件打开时句柄之后会写回目录项，直接修改句柄中的目录项；否则重新读取目录项，
+    // 避免用查找时的旧目录项覆盖其它线程刚写回的大小和簇号
+    pthread_mutex_lock(&handles_lock);
+    FileHandle* h = handle_find(&slot);
+    if (h != NULL) {
+        pthread_rwlock_wrlock(&h->lock);
+        dir = &(h->slot.dir);
+    } else {
+        ret = slot_refresh(&slot);
+    }
+    if (ret == 0) {
+        time_unix_to_fat(&tv[1], &(dir->DIR_WrtDate), &(dir->DIR_WrtTime), NULL);
+        time_unix_to_fat(&tv[0], &(dir->DIR_LstAccDate), NULL, NULL);
+        ret = dir_entry_write(h != NULL ? h->slot : slot);
+    }
+    if (h != NULL) {
+        pthread_rwlock_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&handles_lock);
     if (ret < 0) {
         return ret;
     }
@@ -977,6 +1903,20 @@ int fat16_utimens(const char* path, const struct timespec tv[2], struct fuse_fil
     return 0;
 }
 
+int fat16_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
+    printf("utimens(path='%s', tv=[%ld.%09ld, %ld.%09ld])\n", path,
+           tv[0].tv_sec, tv[0].tv_nsec, tv[1].tv_sec, tv[1].tv_nsec);
+    // 持有父目录的锁，修改期间目录项不会被 unlink 或 rmdir 删除
+    pthread_mutex_t* locks[2];
+    int ret = lock_dirs(path, false, locks);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = utimens_locked(path, tv);
+    unlock_dirs(locks);
+    return ret;
+}
+
 /**
  * @brief 创建 path 对应的文件夹
  *
@@ -984,8 +1924,7 @@ int fat16_utimens(const char* path, const struct timespec tv[2], struct fuse_fil
  * @param mode 文件模式，本次实验可忽略，默认都为普通文件夹
  * @return int 成功: 0，失败: POSIX 错误代码的负值
  */
-int fat16_mkdir(const char* path, mode_t mode) {
-    printf("mkdir(path='%s', mode=%03o)\n", path, mode);
+static int mkdir_locked(const char* path) {
     // DONE: 2.6 参考 fat16_mknod 实现，创建新目录
     // Hint: 注意设置的属性不同。
     // Hint: 新目录最开始即有两个目录项，分别是. 和..，所以需要给新目录分配一个簇。
@@ -997,7 +1936,9 @@ int fat16_mkdir(const char* path, mode_t mode) {
         return ret;
     }
     cluster_t first_clus = 0;
+    pthread_rwlock_wrlock(&fat_lock);
     ret = alloc_clusters(1, &first_clus);
+    fat_write_unlock();
     if (ret < 0) {
         return ret;
     }
@@ -1030,18 +1971,25 @@ int fat16_mkdir(const char* path, mode_t mode) {
     return 0;
 }
 
+int fat16_mkdir(const char* path, mode_t mode) {
+    printf("mkdir(path='%s', mode=%03o)\n", path, mode);
+    pthread_mutex_t* locks[2];
+    int ret = lock_dirs(path, false, locks);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = mkdir_locked(path);
+    unlock_dirs(locks);
+    return ret;
+}
+
 /**
  * @brief 删除 path 对应的文件夹
  *
  * @param path 要删除的文件夹路径
  * @return int 成功: 0， 失败: POSIX 错误代码的负值
  */
-int fat16_rmdir(const char* path) {
-    printf("rmdir(path='%s')\n", path);
-    if (path_is_root(path)) {
-        return -EBUSY;
-    }
-
+static int rmdir_locked(const char* path) {
     DirEntrySlot slot;
     DIR_ENTRY* dir = &(slot.dir);
     int ret = find_entry(path, &slot);
@@ -1054,19 +2002,42 @@ int fat16_rmdir(const char* path) {
 
     // DONE: 请参考 fat16_unlink 实现，实现删除目录功能。
     // Hint: 你只需要删除为空的目录，不为空的目录返回 -ENOTEMPTY 错误即可。
-    if (!dir_empty(dir)) { // 目录非空，返回
+    ret = dir_empty(dir);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret == 0) { // 目录非空，返回
         return -ENOTEMPTY;
     }
+    // 与 fat16_unlink 相同，先通过 dir_entry_write 写回删除的目录项（目录项缓存随之失效），再释放簇
+    dir->DIR_Name[0] = NAME_DELETED;
+    ret = dir_entry_write(slot);
+    if (ret < 0) {
+        return ret;
+    }
+    pthread_rwlock_wrlock(&fat_lock);
     free_clusters(dir->DIR_FstClusLO);
-    char sector_buffer[PHYSICAL_SECTOR_SIZE];
-    sector_read(slot.sector, sector_buffer);
-    // memcpy(sector_buffer + slot.offset, &NAME_DELETED, 1);
-    memset(sector_buffer + slot.offset, NAME_DELETED, 1);
-    sector_write(slot.sector, sector_buffer);
+    fat_write_unlock();
     // Hint: 记得修改下面的返回值
     return 0;
 }
 
+int fat16_rmdir(const char* path) {
+    printf("rmdir(path='%s')\n", path);
+    if (path_is_root(path)) {
+        return -EBUSY;
+    }
+    // 同时持有父目录和该目录的锁，检查为空到删除期间不会有线程在其中创建文件
+    pthread_mutex_t* locks[2];
+    int ret = lock_dirs(path, true, locks);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = rmdir_locked(path);
+    unlock_dirs(locks);
+    return ret;
+}
+
 // ------------------TASK3: 写文件、裁剪文件 -----------------------------------
 
 /**
@@ -1079,68 +2050,87 @@ int fat16_rmdir(const char* path) {
  * @param size      要写入数据的大小（字节）
  * @return ssize_t  成功写入的字节数，失败返回错误代码负值。可能部分成功，此时仅返回成功写入的字节数，不提供错误原因（POSIX 标准）。
  */
-ssize_t write_to_cluster_at_offset(cluster_t clus, off_t offset, const char* data, size_t size) {
-    // DONE: 参考注释，以及 read_from_cluster_at_offset 函数，实现写入簇的功能。
-    assert(offset + size <= meta.cluster_size);  // offset + size 必须小于簇大小
+/**
+ * @brief 向扇区 sec 开始的若干连续扇区中，偏移 offset 处写入 size 字节。
+ *        首尾不完整的扇区需要先读出、保留原来的部分数据，中间的整扇区用 bcache_write_sectors 一次写入。
+ *
+ * @return ssize_t 成功返回写入的字节数
+ */
+static ssize_t write_sectors_at(sector_t sec, size_t offset, const char* data, size_t size) {
     char sector_buffer[PHYSICAL_SECTOR_SIZE];
-
-    uint32_t sec = cluster_first_sector(clus) + offset / meta.sector_size;
+    sec += offset / meta.sector_size;
     size_t sec_off = offset % meta.sector_size;
     size_t pos = 0;
-    int ret;
-    while (pos < size) {
-        size_t len = min(meta.sector_size - sec_off, size - pos);
-        if (len < meta.sector_size) { // 需要保留原来的部分数据
-            ret = sector_read(sec, sector_buffer);
-            if (ret < 0)
-                return ret;
-        }
-        memcpy(sector_buffer + sec_off, data + pos, len);
-        ret = sector_write(sec, sector_buffer);
-        if (ret < 0)
-            return ret;
-        pos += len;
-        sec_off = 0;
+    if (sec_off != 0 || size < meta.sector_size) {
+        if (bcache_read(sec, sector_buffer) != 0)
+            return -EIO;
+        pos = min(meta.sector_size - sec_off, size);
+        memcpy(sector_buffer + sec_off, data, pos);
+        if (bcache_write(sec, sector_buffer) != 0)
+            return -EIO;
         sec++;
     }
+    size_t whole = (size - pos) / meta.sector_size;
+    if (whole > 0) {
+        if (bcache_write_sectors(sec, whole, data + pos) != 0)
+            return -EIO;
+        pos += whole * meta.sector_size;
+        sec += whole;
+    }
+    if (pos < size) {
+        if (bcache_read(sec, sector_buffer) != 0)
+            return -EIO;
+        memcpy(sector_buffer, data + pos, size - pos);
+        if (bcache_write(sec, sector_buffer) != 0)
+            return -EIO;
+        pos = size;
+    }
     return pos;
 }
 
+ssize_t write_to_cluster_at_offset(cluster_t clus, off_t offset, const char* data, size_t size) {
+    // DONE: 参考注释，以及 read_from_cluster_at_offset 函数，实现写入簇的功能。
+    assert(offset + size <= meta.cluster_size);  // offset + size 必须小于簇大小
+    return write_sectors_at(cluster_first_sector(clus), offset, data, size);
+}
+
 /**
- * @brief 为文件分配新的簇至足够容纳 size 大小
+ * @brief 为文件分配新的簇至足够容纳 size 大小，新分配的簇同时追加到句柄的簇号数组中。调用者需持有 h->lock 写锁。
  *
- * @param dir 文件的目录项
+ * @param h    文件句柄
  * @param size 所需的大小
  * @return int 成功返回 0
  */
-int file_reserve_clusters(DIR_ENTRY* dir, size_t size) {
+int file_reserve_clusters(FileHandle* h, size_t size) {
     // DONE: 为文件分配新的簇至足够容纳 size 大小
     //   1. 计算需要多少簇
     //   2. 如果文件没有簇，直接分配足够的簇
-    //   3. 如果文件已有簇，找到最后一个簇（哪个簇是当前该文件的最后一个簇？），并计算需要额外分配多少个簇
+    //   3. 如果文件已有簇，最后一个簇就是 h->clusters 的最后一项，计算需要额外分配多少个簇
     //   4. 分配额外的簇，并将分配好的簇连在最后一个簇后
-    cluster_t clus_cnt = 0;
-    cluster_t clus = dir->DIR_FstClusLO;
-    cluster_t last = CLUSTER_END; // 循环结束后值为最后的 cluster
-    if (size > dir->DIR_FileSize) {
-        dir->DIR_FileSize = size;
-    }
-    while (is_cluster_inuse(clus)) {
-        clus_cnt++;
-        last = clus;
-        clus = read_fat_entry(clus);
-    }
-    if (size > clus_cnt * meta.cluster_size) {
-        cluster_t added_clus_cnt = (size + meta.cluster_size - 1) / meta.cluster_size - clus_cnt;
+    DIR_ENTRY* dir = &(h->slot.dir);
+    size_t clus_cnt = (size + meta.cluster_size - 1) / meta.cluster_size;
+    if (clus_cnt > h->nclus) {
+        if (handle_reserve(h, clus_cnt) < 0)
+            return -ENOMEM;
+        cluster_t last = h->nclus > 0 ? h->clusters[h->nclus - 1] : CLUSTER_END;
         cluster_t added_clus_fst;
-        int ret = alloc_clusters(added_clus_cnt, &added_clus_fst);
-        if (ret < 0)
+        pthread_rwlock_wrlock(&fat_lock);
+        int ret = alloc_clusters_after(last, clus_cnt - h->nclus, ALLOC_WINDOW, &added_clus_fst);
+        if (ret < 0) {
+            fat_write_unlock();
             return ret;
+        }
         if (last == CLUSTER_END) {
             dir->DIR_FstClusLO = added_clus_fst;
         } else {
             write_fat_entry(last, added_clus_fst);
         }
+        handle_append_chain(h, added_clus_fst);
+        fat_write_unlock();
+    }
+    // 分配成功后才更新大小：句柄中的目录项是共用的，分配失败时不能留下超出簇链的大小
+    if (size > dir->DIR_FileSize) {
+        dir->DIR_FileSize = size;
     }
     return 0;
 }
@@ -1176,35 +2166,51 @@ int fat16_write(const char* path, const char* data, size_t size, off_t offset, s
         return 0;
     if (offset + size < offset) // 溢出
         return -EINVAL;
-    // 1
-    DirEntrySlot slot;
-    DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);
+    // 1（打开文件时已查找过，直接使用句柄）
+    FileHandle* h;
+    int ret = handle_of(path, fi, &h);
     if (ret < 0)
         return ret;
-    if (is_directory(dir->DIR_Attr))
-        return -EISDIR;
-    if (offset > dir->DIR_FileSize)
-        return -EINVAL;
-    // 2
-    ret = file_reserve_clusters(dir, offset + size);
-    if (ret < 0)
+    // 写操作独占文件句柄：簇号数组、文件大小都可能改变
+    pthread_rwlock_wrlock(&h->lock);
+    DIR_ENTRY* dir = &(h->slot.dir);
+    DWORD old_size = dir->DIR_FileSize;
+    if (h->unlinked) {
+        ret = -ENOENT;
+    } else if (offset > dir->DIR_FileSize) {
+        ret = -EINVAL;
+    } else {
+        // 2
+        ret = file_reserve_clusters(h, offset + size);
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&h->lock);
+        handle_put(h);
         return ret;
+    }
     // 3
-    cluster_t clus = dir->DIR_FstClusLO;
+    // 与读取相同，直接定位到 offset 所在的簇，磁盘上连续的簇合并为一段写入
+    size_t i = offset / meta.cluster_size;
+    size_t clus_off = offset % meta.cluster_size;
     size_t p = 0;
-    while (p < size) {
-        if (offset > meta.cluster_size) {
-            offset -= meta.cluster_size;
-        } else {
-            ret = write_to_cluster_at_offset(clus, offset, data + p, min(size - p, meta.cluster_size - offset));
-            p += ret;
-            offset = 0;
+    while (p < size && i < h->nclus) {
+        size_t last = handle_run_end(h, i, clus_off, size - p);
+        size_t len = min(size - p, (last - i + 1) * meta.cluster_size - clus_off);
+        ret = write_sectors_at(cluster_first_sector(h->clusters[i]), clus_off, data + p, len);
+        if (ret < 0) {
+            dir->DIR_FileSize = max(old_size, offset + p);  // 大小只包含已经写入的部分
+            pthread_rwlock_unlock(&h->lock);
+            handle_put(h);
+            return ret;
         }
-        clus = read_fat_entry(clus);
+        p += ret;
+        clus_off = 0;
+        i = last + 1;
     }
     // 4
-    ret = dir_entry_write(slot);
+    ret = dir_entry_write(h->slot);
+    pthread_rwlock_unlock(&h->lock);
+    handle_put(h);
     if (ret < 0)
         return ret;
     // 5
@@ -1226,67 +2232,60 @@ int fat16_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
     if (path_is_root(path))
         return -EISDIR;
     // DONE: 裁剪文件。
-    // 1. 通过 path 获取到对应的目录项，即 DIR_ENTRY 结构体，通过调用 find_entry 即可
-    DirEntrySlot slot;
-    DIR_ENTRY* dir = &(slot.dir);
-    int ret = find_entry(path, &slot);
+    // 1. 取得文件的句柄（ftruncate 时使用打开时的句柄，否则按路径查找）
+    FileHandle* h;
+    int ret = handle_of(path, fi, &h);
     if (ret < 0)
         return ret;
-    if (is_directory(dir->DIR_Attr))
-        return -EISDIR;
-
-    // 2. 计算并比较原文件拥有的簇数量 n1 ，和文件截断后需要的新簇数量 n2 。通过比较 n1 和 n2 的大小，来判断文件是否需要新增或释放簇：
-    off_t old_size = dir->DIR_FileSize;
-    // new_size = size
-    cluster_t old_clus_cnt = 0;
-    cluster_t new_clus_cnt = (size + meta.cluster_size - 1) / meta.cluster_size;
-    cluster_t clus = dir->DIR_FstClusLO;
-    cluster_t last = CLUSTER_END; // clus 之前的 cluster
-    while (is_cluster_inuse(clus)) {
-        old_clus_cnt++;
-        last = clus;
-        clus = read_fat_entry(clus);
+    pthread_rwlock_wrlock(&h->lock);
+    DIR_ENTRY* dir = &(h->slot.dir);
+    if (h->unlinked) {
+        pthread_rwlock_unlock(&h->lock);
+        handle_put(h);
+        return -ENOENT;
     }
-    if (old_clus_cnt == new_clus_cnt) { // a. n1 == n2 ：此时不需要任何操作
-        return 0;
-    } else if (old_clus_cnt < new_clus_cnt) { // b. n1 < n2 ：此时需要扩容文件大小，可以参照 fat16_write 实现思路。
-        cluster_t added_clus_fst;
-        // printf("[fat16_truncate] Extending file: allocating clusters %d -> %d...\n", old_clus_cnt, new_clus_cnt);
-        ret = alloc_clusters(new_clus_cnt - old_clus_cnt, &added_clus_fst);
-        // printf("[fat16_truncate] Allocated first cluster: #%x.\n", added_clus_fst);
-        if (ret < 0)
+
+    // 2. 比较原文件拥有的簇数量 n1 ，和文件截断后需要的新簇数量 n2 ，判断文件是否需要新增或释放簇：
+    size_t old_clus_cnt = h->nclus;
+    size_t new_clus_cnt = (size + meta.cluster_size - 1) / meta.cluster_size;
+    if (old_clus_cnt < new_clus_cnt) { // b. n1 < n2 ：此时需要扩容文件大小，与 fat16_write 相同
+        ret = file_reserve_clusters(h, size);
+        if (ret < 0) {
+            pthread_rwlock_unlock(&h->lock);
+            handle_put(h);
             return ret;
-        if (last == CLUSTER_END) {
-            dir->DIR_FstClusLO = added_clus_fst;
-        } else {
-            write_fat_entry(last, added_clus_fst);
-        }
-    } else { // c. n1 > n2 ：此时需要截断文件，找到文件的第 n2 个簇，更改 FAT 表项，将此处改为文件末尾，并释放后续所有簇。（释放可使用 Part1 中的 free_clusters 函数。）
-        // printf("[fat16_truncate] Shrinking file: %d -> %d...\n", old_clus_cnt, new_clus_cnt);
-        clus = dir->DIR_FstClusLO;
-        for (int i = 0; i < new_clus_cnt; i++) {
-            last = clus;
-            clus = read_fat_entry(clus);
         }
+    } else if (old_clus_cnt > new_clus_cnt) { // c. n1 > n2 ：将第 n2 个簇改为文件末尾，并释放后续所有簇
+        // 先写回变短的目录项再修改 FAT：中途写回磁盘时最多多占一些簇，不会出现目录项引用空闲簇
+        cluster_t new_last = new_clus_cnt == 0 ? CLUSTER_END : h->clusters[new_clus_cnt - 1];
+        cluster_t first_freed = h->clusters[new_clus_cnt];
         if (new_clus_cnt == 0) {
             dir->DIR_FstClusLO = CLUSTER_END;
-        } else {
-            write_fat_entry(last, CLUSTER_END);
         }
-        // printf("[fat16_truncate] Freeing cluster from #%x...", clus);
-        free_clusters(clus);
+        h->nclus = new_clus_cnt;
+        dir->DIR_FileSize = size;
+        ret = dir_entry_write(h->slot);
+        if (ret == 0) {
+            pthread_rwlock_wrlock(&fat_lock);
+            if (new_last != CLUSTER_END) {
+                write_fat_entry(new_last, CLUSTER_END);
+            }
+            free_clusters(first_freed);
+            fat_write_unlock();
+        }
+        pthread_rwlock_unlock(&h->lock);
+        handle_put(h);
+        return ret < 0 ? ret : 0;
     }
     dir->DIR_FileSize = size;
 
-    // 3. 按需写入，比较新文件的大小 new_size （就是参数中的 size ） 和原来的文件大小 old_size :
-
-    // a. new_size > old_size ：需要从 old_size 位置开始，将后续文件数据清空为 0x00 。如果你正确实现了 alloc_clusters ，那么新分配的簇应该已经清空，而已有的最后一个簇的末尾也在上一次分配时清空过。
-    // b. new_size <= old_size ：不需要进行任何操作
-    // c. 实现目录项的更新，通过 find_entry 可以获取到目录项对应的偏移量，更新对应的目录项数据写入即可
-    dir_entry_write(slot);
+    // 3. 新分配的簇已经清空，已有的最后一个簇的末尾也在上一次分配时清空过，只需要更新目录项
+    ret = dir_entry_write(h->slot);
+    pthread_rwlock_unlock(&h->lock);
+    handle_put(h);
 
     // 4. 返回 0 表示正常结束，否则表示异常
-    return 0;
+    return ret < 0 ? ret : 0;
 }
 
 struct fuse_operations fat16_oper = {
@@ -1309,5 +2308,11 @@ struct fuse_operations fat16_oper = {
 
     // TASK4: echo "hello world!" > [file] ;  echo "hello world!" >> [file]
     .write = fat16_write,
-    .truncate = fat16_truncate
+    .truncate = fat16_truncate,
+    .fsync = fat16_fsync,
+
+    // 打开的文件缓存目录项和簇号数组
+    .open = fat16_open,
+    .create = fat16_create,
+    .release = fat16_release
 };
@@ -0,0 +1,93 @@
+import os, sys
+import random
+import threading
+from time import perf_counter as pc
+
+FILES = 8           # 每个线程的文件数（子目录只有一个簇，不宜过多）
+SIZE = 256 * 1024   # 每个文件的大小
+CHUNK = 4096
+OPS = 1600          # 每轮总的随机读写次数，平均分给各线程
+
+def prepare(dir, t):
+    # 每个线程在自己的目录下创建、写入文件，返回文件名和每个文件的预期内容
+    d = os.path.join(dir, f't{t:02}')
+    os.makedirs(d, mode=0o777, exist_ok=True)
+    files, expected = [], []
+    for i in range(FILES):
+        f = os.path.join(d, f'f{i:02}.bin')
+        data = bytearray([t * FILES + i & 0xff]) * SIZE
+        with open(f, 'wb') as fp:
+            fp.write(data)
+        files.append(f)
+        expected.append(data)
+    return files, expected
+
+def worker(files, expected, t, ops, errors):
+    # 文件只由本线程修改，预期内容随写入同步更新，每次读取都和它比较
+    r = random.Random(t)
+    for i in range(ops):
+        k = r.randrange(len(files))
+        st = r.randrange(0, SIZE // CHUNK) * CHUNK
+        if i % 4 == 0:  # 四分之一是写
+            data = bytes([r.randrange(256)]) * CHUNK
+            with open(files[k], 'r+b') as fp:
+                fp.seek(st)
+                fp.write(data)
+            expected[k][st:st + CHUNK] = data
+        else:
+            with open(files[k], 'rb') as fp:
+                fp.seek(st)
+                if fp.read(CHUNK) != expected[k][st:st + CHUNK]:
+                    errors.append(f'{files[k]} at {st}')
+    # 最后读出整个文件，检查没有丢失或者被撕裂的写入
+    for f, data in zip(files, expected):
+        with open(f, 'rb') as fp:
+            if fp.read() != data:
+                errors.append(f'{f} (full read)')
+    # 每个线程在共享目录中创建、删除文件，检查目录操作的并发
+    name = os.path.join('shared', f's{t:02}.txt')
+    with open(name, 'w') as fp:
+        fp.write('x' * 100)
+    with open(name, 'r') as fp:
+        if fp.read() != 'x' * 100:
+            errors.append(name)
+    os.unlink(name)
+
+def run(n):
+    prepared = [prepare('.', t) for t in range(n)]
+    errors = []
+    threads = [threading.Thread(target=worker, args=(*prepared[t], t, OPS // n, errors)) for t in range(n)]
+    t0 = pc()
+    for th in threads:
+        th.start()
+    for th in threads:
+        th.join()
+    elapsed = pc() - t0
+    if errors:
+        print(f'{n} threads: {len(errors)} mismatches, e.g. {errors[:5]}', flush=True)
+    return elapsed, len(errors)
+
+def stress(dir, counts):
+    os.chdir(dir)
+    os.makedirs('stress/shared', mode=0o777, exist_ok=True)
+    os.chdir('stress/')
+    base = None
+    failures = 0
+    for n in counts:
+        t, bad = run(n)
+        failures += bad
+        base = base or t
+        print(f'{n:2} threads: {t:.3f}s, speedup {base / t:.2f}x', flush=True)
+    return failures
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('Usage: python3 fat16_stress.py <dir> [threads ...]')
+        exit(1)
+    dir = sys.argv[1]
+    counts = [int(x) for x in sys.argv[2:]] or [1, 2, 4, 8]
+    print(f'Run stress test in {dir}')
+    if stress(dir, counts) > 0:
+        print('FAILED: data read back does not match what was written')
+        exit(1)
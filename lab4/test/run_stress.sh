@@ -0,0 +1,22 @@
+#!/bin/bash
+PS4='> $ '
+# set -x
+
+# cd correct directory
+cd "$(dirname "$0")"
+
+# generate image
+rm -f ./fat16-test-32M.img
+mkfs.fat -C -F 16 -r 512 -R 32 -s 4 -S 512 ./fat16-test-32M.img $((32*1024))
+
+rm -rf ./fat16
+mkdir -p ./fat16
+
+# 不加 -s，使用 FUSE 的多线程事件循环
+fusermount -zu ./fat16
+make -C .. debug
+../simple_fat16 ./fat16 --img="./fat16-test-32M.img" --seek_time=10
+python3 ./fat16_stress.py ./fat16 1 2 4 8 | tee /tmp/stress_time.txt
+status=${PIPESTATUS[0]}  # 读回的数据不一致时非零
+fusermount -zu ./fat16
+exit $status